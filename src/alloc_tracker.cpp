@@ -0,0 +1,179 @@
+#include "alloc_tracker.h"
+
+#ifdef ALLOC_TRACKING
+
+#include "metrics.h"
+#include "logger.h"
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+
+namespace {
+
+struct Counters {
+    std::atomic<long long> allocs;
+    std::atomic<long long> bytes;
+    std::atomic<long long> peakLive;
+    std::atomic<long long> jsonDoms;
+    std::atomic<long long> jsonBytes;
+};
+
+// Last slot of each: allocations outside any opcode or phase
+const int OPCODE_SLOTS = MetricsRegistry::MAX_OPCODE + 1;
+const int PHASE_SLOTS = MetricsRegistry::PHASE_COUNT + 1;
+
+// Zero-initialised statics: usable by allocations made before main()
+Counters opcodeCounters[OPCODE_SLOTS];
+Counters phaseCounters[PHASE_SLOTS];
+Counters totals;
+std::atomic<long long> liveBytes;
+
+thread_local int currentOpcode = -1;
+thread_local int currentPhase = -1;
+
+int opcodeSlot(int opcode) {
+    return (opcode >= 0 && opcode < MetricsRegistry::MAX_OPCODE) ? opcode : MetricsRegistry::MAX_OPCODE;
+}
+
+int phaseSlot(int phase) {
+    return (phase >= 0 && phase < MetricsRegistry::PHASE_COUNT) ? phase : MetricsRegistry::PHASE_COUNT;
+}
+
+void raisePeak(std::atomic<long long>& peak, long long live) {
+    long long seen = peak.load(std::memory_order_relaxed);
+    while (live > seen && !peak.compare_exchange_weak(seen, live, std::memory_order_relaxed)) {}
+}
+
+void count(Counters& c, long long size, long long live) {
+    c.allocs.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(size, std::memory_order_relaxed);
+    raisePeak(c.peakLive, live);
+}
+
+void resetCounters(Counters& c, long long live) {
+    c.allocs = 0;
+    c.bytes = 0;
+    c.peakLive = live;
+    c.jsonDoms = 0;
+    c.jsonBytes = 0;
+}
+
+// Sizes come from the allocator, so delete needs no header to know them
+void* trackedAlloc(size_t size) {
+    void* p = malloc(size ? size : 1);
+    if (!p) return nullptr;
+
+    long long usable = (long long)malloc_usable_size(p);
+    long long live = liveBytes.fetch_add(usable, std::memory_order_relaxed) + usable;
+    count(totals, usable, live);
+    count(phaseCounters[phaseSlot(currentPhase)], usable, live);
+    if (currentOpcode >= 0) count(opcodeCounters[opcodeSlot(currentOpcode)], usable, live);
+    return p;
+}
+
+void trackedFree(void* p) {
+    if (!p) return;
+    liveBytes.fetch_sub((long long)malloc_usable_size(p), std::memory_order_relaxed);
+    free(p);
+}
+
+void logCounters(const char* kind, const char* name, const Counters& c) {
+    if (c.allocs == 0 && c.jsonDoms == 0) return;
+    logMsg("Alloc %s %s: %lld allocs, %lld KB, peak live %lld KB, %lld json DOMs (%lld KB)",
+           kind, name, (long long)c.allocs, c.bytes / 1024, c.peakLive / 1024,
+           (long long)c.jsonDoms, c.jsonBytes / 1024);
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    void* p = trackedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    void* p = trackedAlloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return trackedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return trackedAlloc(size);
+}
+
+void operator delete(void* p) noexcept { trackedFree(p); }
+void operator delete[](void* p) noexcept { trackedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { trackedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { trackedFree(p); }
+
+namespace AllocTracker {
+
+void reset() {
+    long long live = liveBytes;
+    for (int i = 0; i < OPCODE_SLOTS; i++) resetCounters(opcodeCounters[i], 0);
+    for (int i = 0; i < PHASE_SLOTS; i++) resetCounters(phaseCounters[i], live);
+    resetCounters(totals, live);
+}
+
+void beginRequest(int opcode) {
+    currentOpcode = opcode;
+}
+
+void endRequest() {
+    currentOpcode = -1;
+}
+
+int setPhase(int phase) {
+    int previous = currentPhase;
+    currentPhase = phase;
+    return previous;
+}
+
+void noteJsonDom(long long bytes) {
+    if (bytes < 0) bytes = 0; // Other threads allocated meanwhile
+    Counters* targets[3] = {
+        &totals,
+        &phaseCounters[phaseSlot(currentPhase)],
+        currentOpcode >= 0 ? &opcodeCounters[opcodeSlot(currentOpcode)] : nullptr
+    };
+    for (int i = 0; i < 3; i++) {
+        if (!targets[i]) continue;
+        targets[i]->jsonDoms.fetch_add(1, std::memory_order_relaxed);
+        targets[i]->jsonBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+long long heapInUse() {
+    // Large blocks are mmapped outside the arena and counted in hblkhd.
+    // mallinfo() is deprecated from glibc 2.33 and its int fields wrap.
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return (long long)(info.uordblks + info.hblkhd);
+#else
+    struct mallinfo info = mallinfo();
+    return (long long)(unsigned)info.uordblks + (long long)(unsigned)info.hblkhd;
+#endif
+}
+
+void logSummary() {
+    logMsg("Alloc: %lld KB live now; json DOMs are those of protocol messages only", (long long)liveBytes / 1024);
+    logCounters("session", "total", totals);
+    for (int p = 0; p < PHASE_SLOTS; p++) {
+        logCounters("phase", p < MetricsRegistry::PHASE_COUNT ? MetricsRegistry::phaseName(p) : "other",
+                    phaseCounters[p]);
+    }
+    // An opcode's peak is that of the whole heap while it was being handled
+    for (int i = 0; i < OPCODE_SLOTS; i++) {
+        logCounters("opcode", MetricsRegistry::opcodeName(i), opcodeCounters[i]);
+    }
+}
+
+} // namespace AllocTracker
+
+#endif // ALLOC_TRACKING
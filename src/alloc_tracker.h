@@ -0,0 +1,61 @@
+#ifndef ALLOC_TRACKER_H
+#define ALLOC_TRACKER_H
+
+#include <cstddef>
+
+// Heap accounting per opcode and per session phase, for builds configured
+// with -DALLOC_TRACKING=ON. Such builds replace the global operator new and
+// delete; everything below compiles to nothing otherwise.
+//
+// Allocations are attributed to the opcode and phase of the thread making
+// them, so work the DB writer does for a request lands in its SQLite phase
+// rather than on the opcode. json-c allocates with malloc, which the hooks
+// do not see: its DOMs are measured when the protocol frees them instead,
+// so the DOMs built for the legacy cache migration and the metrics file
+// are not counted.
+namespace AllocTracker {
+
+#ifdef ALLOC_TRACKING
+
+// Zeroes the counters; peaks restart from the current live heap
+void reset();
+
+// Brackets a request on the connection thread
+void beginRequest(int opcode);
+void endRequest();
+
+// Phase of the calling thread (MetricsRegistry::Phase), -1 for none.
+// Returns the previous one, to restore when a nested phase ends.
+int setPhase(int phase);
+
+// A json-c DOM of `bytes` was released
+void noteJsonDom(long long bytes);
+
+// Heap in use by malloc, arena and mmapped blocks, for measuring json-c
+long long heapInUse();
+
+void logSummary();
+
+#else
+
+inline void reset() {}
+inline void beginRequest(int) {}
+inline void endRequest() {}
+inline int setPhase(int) { return -1; }
+inline void noteJsonDom(long long) {}
+inline long long heapInUse() { return 0; }
+inline void logSummary() {}
+
+#endif
+
+inline bool enabled() {
+#ifdef ALLOC_TRACKING
+    return true;
+#else
+    return false;
+#endif
+}
+
+} // namespace AllocTracker
+
+#endif // ALLOC_TRACKER_H
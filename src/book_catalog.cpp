@@ -0,0 +1,308 @@
+#include "book_catalog.h"
+#include <cstring>
+
+// --- StringPool ---
+
+StringPool::StringPool()
+    : interned(64, Hash(&data), Equal(&data)) {
+    data.push_back('\0'); // Id 0: empty string
+}
+
+size_t StringPool::Hash::operator()(Id id) const {
+    // FNV-1a over the stored C string
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&(*data)[id]);
+    size_t h = 2166136261u;
+    while (*p) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool StringPool::Equal::operator()(Id a, Id b) const {
+    return a == b || strcmp(&(*data)[a], &(*data)[b]) == 0;
+}
+
+StringPool::Id StringPool::append(const std::string& str) {
+    Id id = (Id)data.size();
+    data.insert(data.end(), str.begin(), str.end());
+    data.push_back('\0');
+    return id;
+}
+
+StringPool::Id StringPool::intern(const std::string& str) {
+    if (str.empty()) return EMPTY;
+
+    // Append tentatively so the set can hash/compare it in place,
+    // then roll back if an equal string is already stored
+    Id id = append(str);
+    std::unordered_set<Id, Hash, Equal>::const_iterator it = interned.find(id);
+    if (it != interned.end()) {
+        data.resize(id);
+        return *it;
+    }
+    interned.insert(id);
+    return id;
+}
+
+StringPool::Id StringPool::add(const std::string& str) {
+    if (str.empty()) return EMPTY;
+    return append(str);
+}
+
+size_t StringPool::bytesUsed() const {
+    // Buckets plus one node (value + next pointer + cached hash) per entry
+    return data.capacity()
+         + interned.bucket_count() * sizeof(void*)
+         + interned.size() * (sizeof(Id) + 2 * sizeof(void*));
+}
+
+void StringPool::clear() {
+    interned.clear();
+    data.clear();
+    data.push_back('\0');
+}
+
+// --- BookRef ---
+
+const char* BookRef::uuid() const { return catalog->pool.get(catalog->uuid[index]); }
+const char* BookRef::title() const { return catalog->pool.get(catalog->title[index]); }
+const char* BookRef::authors() const { return catalog->pool.get(catalog->authors[index]); }
+const char* BookRef::series() const { return catalog->pool.get(catalog->series[index]); }
+const char* BookRef::publisher() const { return catalog->pool.get(catalog->publisher[index]); }
+const char* BookRef::fileName() const { return catalog->pool.get(catalog->fileName[index]); }
+const char* BookRef::lastModified() const { return catalog->pool.get(catalog->lastModified[index]); }
+const char* BookRef::lastReadDate() const { return catalog->pool.get(catalog->lastReadDate[index]); }
+int BookRef::seriesIndex() const { return catalog->seriesIndex[index]; }
+long long BookRef::size() const { return catalog->fileSize[index]; }
+int BookRef::storageId() const { return catalog->storageId[index]; }
+int BookRef::dbBookId() const { return catalog->dbBookId[index]; }
+bool BookRef::isRead() const { return (catalog->flags[index] & BookCatalog::FLAG_READ) != 0; }
+bool BookRef::isFavorite() const { return (catalog->flags[index] & BookCatalog::FLAG_FAVORITE) != 0; }
+
+const char* BookRef::folder() const {
+    return catalog->pool.get(catalog->folderNames[catalog->folderId[index]]);
+}
+
+std::string BookRef::lpath() const {
+    const char* dir = folder();
+    std::string result;
+    if (*dir) {
+        result.reserve(strlen(dir) + 1 + strlen(fileName()));
+        result = dir;
+        result += '/';
+    }
+    result += fileName();
+    return result;
+}
+
+BookMetadata BookRef::toMetadata() const {
+    BookMetadata meta;
+    meta.uuid = uuid();
+    meta.title = title();
+    meta.authors = authors();
+    meta.lpath = lpath();
+    meta.series = series();
+    meta.seriesIndex = seriesIndex();
+    meta.publisher = publisher();
+    meta.lastModified = lastModified();
+    meta.size = size();
+    meta.isRead = isRead();
+    meta.lastReadDate = lastReadDate();
+    meta.isFavorite = isFavorite();
+    meta.dbBookId = dbBookId();
+    return meta;
+}
+
+// --- BookCatalog ---
+
+BookCatalog::BookCatalog() {
+}
+
+void BookCatalog::clear() {
+    pool.clear();
+    folderNames.clear();
+    folderIds.clear();
+    uuid.clear();
+    title.clear();
+    authors.clear();
+    series.clear();
+    publisher.clear();
+    fileName.clear();
+    lastModified.clear();
+    lastReadDate.clear();
+    folderId.clear();
+    seriesIndex.clear();
+    fileSize.clear();
+    dbBookId.clear();
+    storageId.clear();
+    flags.clear();
+    lpathIndex.clear();
+}
+
+void BookCatalog::reserve(size_t count) {
+    uuid.reserve(count);
+    title.reserve(count);
+    authors.reserve(count);
+    series.reserve(count);
+    publisher.reserve(count);
+    fileName.reserve(count);
+    lastModified.reserve(count);
+    lastReadDate.reserve(count);
+    folderId.reserve(count);
+    seriesIndex.reserve(count);
+    fileSize.reserve(count);
+    dbBookId.reserve(count);
+    storageId.reserve(count);
+    flags.reserve(count);
+    lpathIndex.reserve(count);
+}
+
+uint32_t BookCatalog::folderIdFor(const std::string& folder) {
+    StringPool::Id nameId = pool.intern(folder);
+    std::unordered_map<StringPool::Id, uint32_t>::const_iterator it = folderIds.find(nameId);
+    if (it != folderIds.end()) {
+        return it->second;
+    }
+    uint32_t id = (uint32_t)folderNames.size();
+    folderNames.push_back(nameId);
+    folderIds[nameId] = id;
+    return id;
+}
+
+size_t BookCatalog::hashLpath(const std::string& lpath) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < lpath.size(); i++) {
+        h ^= (unsigned char)lpath[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void BookCatalog::append(const BookMetadata& meta, int storage) {
+    std::string dir, file;
+    size_t lastSlash = meta.lpath.find_last_of('/');
+    if (lastSlash == std::string::npos) {
+        file = meta.lpath;
+    } else {
+        dir = meta.lpath.substr(0, lastSlash);
+        file = meta.lpath.substr(lastSlash + 1);
+    }
+
+    uint32_t row = (uint32_t)size();
+
+    uuid.push_back(pool.add(meta.uuid));
+    title.push_back(pool.add(meta.title));
+    authors.push_back(pool.intern(meta.authors));
+    series.push_back(pool.intern(meta.series));
+    publisher.push_back(pool.intern(meta.publisher));
+    fileName.push_back(pool.add(file));
+    lastModified.push_back(pool.add(meta.lastModified));
+    lastReadDate.push_back(pool.add(meta.lastReadDate));
+    folderId.push_back(folderIdFor(dir));
+    seriesIndex.push_back(meta.seriesIndex);
+    fileSize.push_back(meta.size);
+    dbBookId.push_back(meta.dbBookId);
+    storageId.push_back((uint8_t)storage);
+    flags.push_back((meta.isRead ? FLAG_READ : 0) | (meta.isFavorite ? FLAG_FAVORITE : 0));
+
+    lpathIndex.insert(std::make_pair(hashLpath(meta.lpath), row));
+}
+
+int BookCatalog::find(const std::string& lpath) const {
+    typedef std::unordered_multimap<size_t, uint32_t>::const_iterator Iter;
+    std::pair<Iter, Iter> range = lpathIndex.equal_range(hashLpath(lpath));
+    for (Iter it = range.first; it != range.second; ++it) {
+        if (at(it->second).lpath() == lpath) {
+            return (int)it->second;
+        }
+    }
+    return -1;
+}
+
+void BookCatalog::remove(size_t index) {
+    if (index >= size()) return;
+
+    // Drop the row's entry and renumber the rows after it, without
+    // rehashing any lpath
+    typedef std::unordered_multimap<size_t, uint32_t>::iterator Iter;
+    std::pair<Iter, Iter> range = lpathIndex.equal_range(hashLpath(at(index).lpath()));
+    for (Iter it = range.first; it != range.second; ++it) {
+        if (it->second == index) {
+            lpathIndex.erase(it);
+            break;
+        }
+    }
+    for (Iter it = lpathIndex.begin(); it != lpathIndex.end(); ++it) {
+        if (it->second > index) it->second--;
+    }
+
+    uuid.erase(uuid.begin() + index);
+    title.erase(title.begin() + index);
+    authors.erase(authors.begin() + index);
+    series.erase(series.begin() + index);
+    publisher.erase(publisher.begin() + index);
+    fileName.erase(fileName.begin() + index);
+    lastModified.erase(lastModified.begin() + index);
+    lastReadDate.erase(lastReadDate.begin() + index);
+    folderId.erase(folderId.begin() + index);
+    seriesIndex.erase(seriesIndex.begin() + index);
+    fileSize.erase(fileSize.begin() + index);
+    dbBookId.erase(dbBookId.begin() + index);
+    storageId.erase(storageId.begin() + index);
+    flags.erase(flags.begin() + index);
+}
+
+void BookCatalog::setSyncState(size_t index, bool isRead, bool isFavorite, const std::string& readDate) {
+    flags[index] = (isRead ? FLAG_READ : 0) | (isFavorite ? FLAG_FAVORITE : 0);
+    if (readDate != pool.get(lastReadDate[index])) {
+        lastReadDate[index] = pool.intern(readDate);
+    }
+}
+
+void BookCatalog::setSeries(size_t index, const std::string& value, int valueIndex) {
+    series[index] = pool.intern(value);
+    seriesIndex[index] = valueIndex;
+}
+
+template <typename T>
+static size_t columnBytes(const std::vector<T>& column) {
+    return column.capacity() * sizeof(T);
+}
+
+size_t BookCatalog::bytesUsed() const {
+    size_t bytes = pool.bytesUsed();
+    bytes += columnBytes(folderNames);
+    bytes += folderIds.bucket_count() * sizeof(void*)
+           + folderIds.size() * (sizeof(StringPool::Id) + sizeof(uint32_t) + 2 * sizeof(void*));
+    bytes += columnBytes(uuid) + columnBytes(title) + columnBytes(authors)
+           + columnBytes(series) + columnBytes(publisher) + columnBytes(fileName)
+           + columnBytes(lastModified) + columnBytes(lastReadDate) + columnBytes(folderId)
+           + columnBytes(seriesIndex) + columnBytes(fileSize) + columnBytes(dbBookId)
+           + columnBytes(storageId) + columnBytes(flags);
+    bytes += lpathIndex.bucket_count() * sizeof(void*)
+           + lpathIndex.size() * (sizeof(size_t) + sizeof(uint32_t) + 2 * sizeof(void*));
+    return bytes;
+}
+
+// Heap used by a std::string of this length (short strings live inline)
+static size_t stringHeapBytes(size_t length) {
+    static const size_t SSO_CAPACITY = 15;
+    return length > SSO_CAPACITY ? length + 1 : 0;
+}
+
+size_t BookCatalog::equivalentMetadataBytes() const {
+    size_t bytes = size() * sizeof(BookMetadata);
+    for (size_t i = 0; i < size(); i++) {
+        BookRef book = at(i);
+        bytes += stringHeapBytes(strlen(book.uuid()));
+        bytes += stringHeapBytes(strlen(book.title()));
+        bytes += stringHeapBytes(strlen(book.authors()));
+        bytes += stringHeapBytes(strlen(book.series()));
+        bytes += stringHeapBytes(strlen(book.publisher()));
+        bytes += stringHeapBytes(book.lpath().size());
+        bytes += stringHeapBytes(strlen(book.lastModified()));
+        bytes += stringHeapBytes(strlen(book.lastReadDate()));
+    }
+    return bytes;
+}
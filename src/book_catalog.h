@@ -0,0 +1,155 @@
+#ifndef BOOK_CATALOG_H
+#define BOOK_CATALOG_H
+
+#include "book_manager.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+// Append-only pool of NUL-terminated strings addressed by 32-bit offsets.
+// Id 0 is always the empty string.
+class StringPool {
+public:
+    typedef uint32_t Id;
+    static const Id EMPTY = 0;
+
+    StringPool();
+
+    // Returns the id of an equal string already in the pool, or stores it
+    Id intern(const std::string& str);
+
+    // Stores the string without deduplication (for mostly-unique values)
+    Id add(const std::string& str);
+
+    // The pointer is into the pool's buffer, which moves when it grows:
+    // it is valid only until the next intern() or add()
+    const char* get(Id id) const { return &data[id]; }
+
+    size_t bytesUsed() const;
+    void clear();
+
+private:
+    struct Hash {
+        const std::vector<char>* data;
+        explicit Hash(const std::vector<char>* d) : data(d) {}
+        size_t operator()(Id id) const;
+    };
+    struct Equal {
+        const std::vector<char>* data;
+        explicit Equal(const std::vector<char>* d) : data(d) {}
+        bool operator()(Id a, Id b) const;
+    };
+
+    std::vector<char> data;
+    std::unordered_set<Id, Hash, Equal> interned;
+
+    Id append(const std::string& str);
+
+    StringPool(const StringPool&);
+    StringPool& operator=(const StringPool&);
+};
+
+class BookCatalog;
+
+// Read-only view of one catalog row. Strings point into the catalog pool and
+// are valid only until the catalog is next modified (append, a setter or
+// clear); copy them before changing the catalog.
+class BookRef {
+public:
+    BookRef(const BookCatalog* catalog, size_t index) : catalog(catalog), index(index) {}
+
+    const char* uuid() const;
+    const char* title() const;
+    const char* authors() const;
+    const char* series() const;
+    const char* publisher() const;
+    const char* folder() const;
+    const char* fileName() const;
+    const char* lastModified() const;
+    const char* lastReadDate() const;
+    int seriesIndex() const;
+    long long size() const;
+    int storageId() const;
+    int dbBookId() const;
+    bool isRead() const;
+    bool isFavorite() const;
+
+    std::string lpath() const;
+
+    // Materialises the row for code that still works on BookMetadata
+    BookMetadata toMetadata() const;
+
+private:
+    const BookCatalog* catalog;
+    size_t index;
+};
+
+// Struct-of-arrays store for the session's book list. Values that repeat
+// across books (authors, series, publisher, folder) are interned; folders
+// and storages are kept as small integer ids.
+class BookCatalog {
+    friend class BookRef;
+public:
+    BookCatalog();
+
+    size_t size() const { return dbBookId.size(); }
+    bool empty() const { return dbBookId.empty(); }
+    void clear();
+    void reserve(size_t count);
+
+    void append(const BookMetadata& meta, int storageId);
+    BookRef at(size_t index) const { return BookRef(this, index); }
+
+    // Returns the row index for an lpath, or -1
+    int find(const std::string& lpath) const;
+
+    // Removes a row; later rows shift down by one like std::vector::erase
+    void remove(size_t index);
+
+    void setSyncState(size_t index, bool isRead, bool isFavorite, const std::string& lastReadDate);
+    void setSeries(size_t index, const std::string& series, int seriesIndex);
+
+    // Heap bytes held by the catalog, including pool and index overhead
+    size_t bytesUsed() const;
+
+    // Heap bytes the same rows would take as std::vector<BookMetadata>
+    size_t equivalentMetadataBytes() const;
+
+private:
+    enum Flags { FLAG_READ = 1, FLAG_FAVORITE = 2 };
+
+    StringPool pool;
+
+    // Folder table: folderId -> interned relative folder name
+    std::vector<StringPool::Id> folderNames;
+    std::unordered_map<StringPool::Id, uint32_t> folderIds;
+
+    // Columns
+    std::vector<StringPool::Id> uuid;
+    std::vector<StringPool::Id> title;
+    std::vector<StringPool::Id> authors;
+    std::vector<StringPool::Id> series;
+    std::vector<StringPool::Id> publisher;
+    std::vector<StringPool::Id> fileName;
+    std::vector<StringPool::Id> lastModified;
+    std::vector<StringPool::Id> lastReadDate;
+    std::vector<uint32_t> folderId;
+    std::vector<int32_t> seriesIndex;
+    std::vector<int64_t> fileSize;
+    std::vector<int32_t> dbBookId;
+    std::vector<uint8_t> storageId;
+    std::vector<uint8_t> flags;
+
+    // lpath hash -> row
+    std::unordered_multimap<size_t, uint32_t> lpathIndex;
+
+    uint32_t folderIdFor(const std::string& folder);
+    static size_t hashLpath(const std::string& lpath);
+
+    BookCatalog(const BookCatalog&);
+    BookCatalog& operator=(const BookCatalog&);
+};
+
+#endif // BOOK_CATALOG_H
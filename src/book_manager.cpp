@@ -1,5 +1,9 @@
 #include "book_manager.h"
+#include "sql_profiler.h"
+#include "collection_sync.h"
 #include "inkview.h"
+#include "logger.h"
+#include "timeline.h"
 #include <sys/stat.h>
 #include <cstring>
 #include <cstdio>
@@ -10,19 +14,9 @@
 #include <cctype>
 #include <unordered_map>
 
-#define LOG_MSG(fmt, ...) { FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a"); if(f) { fprintf(f, "[DB] " fmt "\n", ##__VA_ARGS__); fclose(f); } }
+#define LOG_MSG(...) LOG_AT(LOG_INFO, "DB", __VA_ARGS__)
 
-// --- Cache & Helpers ---
-
-// Кэш для папок и профиля, чтобы не дергать БД на каждой книге
-static int g_cachedProfileId = -1;
-static std::unordered_map<std::string, int> g_folderCache;
-
-// Сброс кэша (можно вызывать при initialize, если нужно)
-static void resetInternalCache() {
-    g_cachedProfileId = -1;
-    g_folderCache.clear();
-}
+// --- Helpers ---
 
 // Быстрый парсинг ISO даты без оверхеда sscanf/strptime
 // Формат: YYYY-MM-DDTHH:MM:SS...
@@ -49,6 +43,24 @@ static time_t fastParseIsoTime(const std::string& isoTime) {
     return timegm(&tm);
 }
 
+static int lookupProfileId(sqlite3* db) {
+    int id = 1; // Default
+    
+    char* profileName = GetCurrentProfile();
+    if (!profileName) return id;
+    
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT id FROM profiles WHERE name = ?", -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, profileName, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            id = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    free(profileName);
+    return id;
+}
+
 static std::string formatIsoTime(time_t timestamp) {
     if (timestamp == 0) return "1970-01-01T00:00:00+00:00";
     char buffer[32];
@@ -57,10 +69,22 @@ static std::string formatIsoTime(time_t timestamp) {
     return std::string(buffer);
 }
 
+// True when `path` is `root` itself or lies below it
+static bool isUnderRoot(const char* path, const std::string& root) {
+    return strncmp(path, root.c_str(), root.size()) == 0 &&
+           (path[root.size()] == '/' || path[root.size()] == '\0');
+}
+
 // --- Implementation ---
 
-BookManager::BookManager() : currentBatchTimestamp(0) {
-    booksDir = FLASHDIR;
+BookManager::BookManager()
+    : currentBatchTimestamp(0), readDb(nullptr), writeDb(nullptr), batchActive(false),
+      batchMaxBooks(0), batchMaxSeconds(0), groupOpen(false), lastGroupCommitted(true), groupBooks(0),
+      groupStarted(0), batchBooks(0), batchCommits(0) {
+    databasePath = SYSTEM_DB_PATH;
+    mainDir = FLASHDIR;
+    cardDir = SDCARDDIR;
+    booksDir = mainDir;
     targetStorage = "main";
 }
 
@@ -69,18 +93,25 @@ bool BookManager::hasSDCard() const {
 }
 
 std::string BookManager::getSDCardPath() const {
-    return SDCARDDIR;
+    return cardDir;
+}
+
+void BookManager::redirectStorage(const std::string& mainRoot, const std::string& cardRoot) {
+    mainDir = mainRoot;
+    cardDir = cardRoot;
+    booksDir = (targetStorage == "carda") ? cardDir : mainDir;
+    LOG_MSG("Storage redirected to %s and %s", mainDir.c_str(), cardDir.c_str());
 }
 
 void BookManager::setTargetStorage(const std::string& storage) {
     if (storage == "carda" && hasSDCard()) {
-        booksDir = SDCARDDIR;
+        booksDir = cardDir;
         targetStorage = "carda";
-        LOG_MSG("Storage switched to SD Card: %s", SDCARDDIR);
+        LOG_MSG("Storage switched to SD Card: %s", cardDir.c_str());
     } else {
-        booksDir = FLASHDIR;
+        booksDir = mainDir;
         targetStorage = "main";
-        LOG_MSG("Storage switched to internal: %s", FLASHDIR);
+        LOG_MSG("Storage switched to internal: %s", mainDir.c_str());
     }
 }
 
@@ -89,10 +120,15 @@ std::string BookManager::getCurrentStorage() const {
 }
 
 BookManager::~BookManager() {
+    closeWriter();
+    closeReadDB();
 }
 
 bool BookManager::initialize(const std::string& dbPath) {
-    resetInternalCache();
+    // New session: start from a fresh copy of the folders table
+    closeReadDB();
+    databasePath = dbPath.empty() ? SYSTEM_DB_PATH : dbPath;
+    folderRegistry.invalidate();
     currentBatchTimestamp = 0;
     return true;
 }
@@ -100,13 +136,13 @@ bool BookManager::initialize(const std::string& dbPath) {
 sqlite3* BookManager::openDB() {
     sqlite3* db;
     // Используем SQLITE_OPEN_READWRITE без CREATE, системная БД должна существовать
-    int rc = sqlite3_open_v2(SYSTEM_DB_PATH.c_str(), &db, SQLITE_OPEN_READWRITE, NULL);
+    int rc = sqlite3_open_v2(databasePath.c_str(), &db, SQLITE_OPEN_READWRITE, NULL);
     if (rc != SQLITE_OK) {
         LOG_MSG("Failed to open DB: %s", sqlite3_errmsg(db));
         if (db) sqlite3_close(db);
         return nullptr;
     }
-    sqlite3_busy_timeout(db, 5000);
+    setBusyHandling(db);
     
     // Ускорение работы с БД
     sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
@@ -116,17 +152,282 @@ sqlite3* BookManager::openDB() {
 }
 
 void BookManager::closeDB(sqlite3* db) {
-    if (db) sqlite3_close(db);
+    if (!db) return;
+    if (profiler) profiler->detach(db);
+    sqlite3_close(db);
+}
+
+void BookManager::setBusyHandling(sqlite3* db) {
+    if (profiler) {
+        profiler->attach(db, BUSY_TIMEOUT_MS);
+    } else {
+        sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    }
+}
+
+sqlite3* BookManager::readDB() {
+    if (readDb) return readDb;
+    
+    int rc = sqlite3_open_v2(databasePath.c_str(), &readDb, SQLITE_OPEN_READONLY, NULL);
+    if (rc != SQLITE_OK) {
+        LOG_MSG("Failed to open read connection: %s", sqlite3_errmsg(readDb));
+        if (readDb) sqlite3_close(readDb);
+        readDb = nullptr;
+        return nullptr;
+    }
+    setBusyHandling(readDb);
+    
+    // Scans touch most of books_impl/files/folders; keep them resident for
+    // the whole session instead of re-reading pages per connection
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = -%d", READ_CACHE_KB);
+    sqlite3_exec(readDb, pragma, NULL, NULL, NULL);
+    snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lld", READ_MMAP_BYTES);
+    sqlite3_exec(readDb, pragma, NULL, NULL, NULL);
+    
+    return readDb;
+}
+
+void BookManager::closeReadDB() {
+    closeDB(readDb);
+    readDb = nullptr;
+}
+
+void BookManager::enableSqlProfiling(bool enabled) {
+    if (enabled == (profiler != nullptr)) return;
+    
+    if (enabled) {
+        profiler.reset(new SqlProfiler());
+    } else {
+        profiler.reset();
+    }
+    LOG_MSG("SQL profiling %s", enabled ? "enabled" : "disabled");
+}
+
+void BookManager::writeSqlProfile() {
+    if (!profiler) return;
+    
+    // Plans come from an untraced read-only connection so the EXPLAIN
+    // statements do not show up in the profile itself
+    sqlite3* planDb = nullptr;
+    if (sqlite3_open_v2(databasePath.c_str(), &planDb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        sqlite3_close(planDb);
+        planDb = nullptr;
+    }
+    
+    profiler->writeReport(SQL_PROFILE_PATH, planDb);
+    profiler->reset();
+    
+    if (planDb) sqlite3_close(planDb);
+}
+
+bool BookManager::syncCollections(const CollectionList& collections) {
+    // Collection sync runs its own transaction on the writer connection
+    if (batchActive) {
+        commitGroup();
+    }
+    sqlite3* db = writerDB();
+    if (!db) return false;
+    
+    CollectionSync sync(this, db);
+    if (!sync.begin()) return false;
+    
+    for (size_t i = 0; i < collections.size(); i++) {
+        const std::string& name = collections[i].first;
+        const std::vector<std::string>& members = collections[i].second;
+        
+        sync.addCollection(name);
+        for (size_t j = 0; j < members.size(); j++) {
+            sync.addMember(name, members[j]);
+        }
+    }
+    return sync.commit();
+}
+
+bool BookManager::checkpoint() {
+    // A FULL checkpoint waits for writers, so never run it against our own
+    // open group: commit it and checkpoint on the same connection instead
+    if (batchActive) {
+        commitGroup();
+    }
+    sqlite3* db = writerDB();
+    if (!db) return false;
+    
+    int walFrames = 0;
+    int checkpointed = 0;
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_FULL, &walFrames, &checkpointed);
+    if (rc != SQLITE_OK) {
+        LOG_MSG("WAL checkpoint failed: %s", sqlite3_errmsg(db));
+    } else {
+        LOG_MSG("WAL checkpoint: %d/%d frames", checkpointed, walFrames);
+    }
+    return rc == SQLITE_OK;
+}
+
+// --- Writer connection ---
+
+sqlite3* BookManager::writerDB() {
+    if (!writeDb) {
+        writeDb = openDB();
+    }
+    return writeDb;
+}
+
+void BookManager::closeWriter() {
+    endIngestBatch();
+    closeDB(writeDb);
+    writeDb = nullptr;
+    // The registry's data_version belongs to the connection just closed
+    folderRegistry.invalidate();
+}
+
+// --- Group-commit ingestion ---
+
+void BookManager::beginIngestBatch(int maxBooks, int maxSeconds) {
+    if (batchActive) return;
+    
+    sqlite3* db = writerDB();
+    if (!db) {
+        LOG_MSG("Ingest batch: failed to open writer, using per-book commits");
+        return;
+    }
+    folderRegistry.revalidate(db);
+    
+    batchActive = true;
+    batchMaxBooks = maxBooks > 0 ? maxBooks : 1;
+    batchMaxSeconds = maxSeconds > 0 ? maxSeconds : 1;
+    groupOpen = false;
+    groupBooks = 0;
+    batchBooks = 0;
+    batchCommits = 0;
+    
+    LOG_MSG("Ingest batch opened (group: %d books / %d s)", batchMaxBooks, batchMaxSeconds);
+}
+
+bool BookManager::endIngestBatch() {
+    if (!batchActive) return true;
+    
+    bool committed = commitGroup();
+    
+    LOG_MSG("Ingest batch closed: %d writes in %d commits", batchBooks, batchCommits);
+    batchActive = false;
+    return committed;
+}
+
+bool BookManager::commitGroup() {
+    if (!groupOpen) return true;
+    
+    groupOpen = false;
+    TimelineSpan span("commit-group", "sqlite");
+    if (sqlite3_exec(writeDb, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_MSG("Ingest batch: commit failed: %s", sqlite3_errmsg(writeDb));
+        sqlite3_exec(writeDb, "ROLLBACK", NULL, NULL, NULL);
+        folderRegistry.invalidate();
+        groupBooks = 0;
+        lastGroupCommitted = false;
+        return false;
+    }
+    
+    lastGroupCommitted = true;
+    batchCommits++;
+    LOG_MSG("Ingest batch: committed group of %d writes", groupBooks);
+    groupBooks = 0;
+    return true;
+}
+
+bool BookManager::flushIngestGroup() {
+    return !batchActive || commitGroup();
+}
+
+void BookManager::discardGroup() {
+    LOG_MSG("Ingest batch: discarding group of %d writes: %s", groupBooks, sqlite3_errmsg(writeDb));
+    sqlite3_exec(writeDb, "ROLLBACK", NULL, NULL, NULL);
+    groupOpen = false;
+    groupBooks = 0;
+    lastGroupCommitted = false;
+    folderRegistry.invalidate();
+}
+
+sqlite3* BookManager::beginWrite() {
+    sqlite3* db = writerDB();
+    if (!db) return nullptr;
+    
+    if (!batchActive) {
+        folderRegistry.revalidate(db);
+        if (sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+            LOG_MSG("Error: begin failed: %s", sqlite3_errmsg(db));
+            return nullptr;
+        }
+        return db;
+    }
+    
+    if (!groupOpen) {
+        if (sqlite3_exec(writeDb, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+            LOG_MSG("Ingest batch: begin failed: %s", sqlite3_errmsg(writeDb));
+            return nullptr;
+        }
+        groupOpen = true;
+        groupStarted = time(NULL);
+    }
+    
+    if (sqlite3_exec(writeDb, "SAVEPOINT book_write", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_MSG("Ingest batch: savepoint failed: %s", sqlite3_errmsg(writeDb));
+        return nullptr;
+    }
+    return writeDb;
+}
+
+bool BookManager::endWrite(sqlite3* db, bool success) {
+    if (!db) return false;
+    
+    if (!batchActive) {
+        if (success && sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            LOG_MSG("Error: commit failed: %s", sqlite3_errmsg(db));
+            success = false;
+        }
+        if (!success) {
+            sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+            // A rollback may have discarded a folder the registry already recorded
+            folderRegistry.invalidate();
+        }
+        return success;
+    }
+    
+    if (success && sqlite3_exec(db, "RELEASE book_write", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_MSG("Ingest batch: release failed: %s", sqlite3_errmsg(db));
+        success = false;
+    }
+    
+    if (success) {
+        groupBooks++;
+        batchBooks++;
+    } else {
+        folderRegistry.invalidate();
+        // Undo only this write; the rest of the group stays. If the savepoint
+        // cannot be unwound the group is in an unknown state and goes too.
+        if (sqlite3_exec(db, "ROLLBACK TO book_write", NULL, NULL, NULL) != SQLITE_OK ||
+            sqlite3_exec(db, "RELEASE book_write", NULL, NULL, NULL) != SQLITE_OK) {
+            discardGroup();
+            return false;
+        }
+    }
+    
+    // The size and age bounds apply at book boundaries; the idle flush
+    // commits whatever is open
+    if (groupBooks >= batchMaxBooks || time(NULL) - groupStarted >= batchMaxSeconds) {
+        if (!commitGroup()) return false;
+    }
+    return success;
 }
 
 int BookManager::getStorageId(const std::string& filename) {
-    if (filename.compare(0, strlen(FLASHDIR), FLASHDIR) == 0) {
-        return 1; // Internal storage
+    if (isUnderRoot(filename.c_str(), mainDir)) {
+        return STORAGE_MAIN;
     }
-    if (filename.compare(0, strlen(SDCARDDIR), SDCARDDIR) == 0) {
-        return 2; // SD Card
+    if (isUnderRoot(filename.c_str(), cardDir)) {
+        return STORAGE_CARD;
     }
-    return (targetStorage == "carda") ? 2 : 1;
+    return (targetStorage == "carda") ? STORAGE_CARD : STORAGE_MAIN;
 }
 
 std::string BookManager::getFirstLetter(const std::string& str) {
@@ -146,42 +447,93 @@ std::string BookManager::getFirstLetter(const std::string& str) {
     return res;
 }
 
-int BookManager::getCurrentProfileId(sqlite3* db) {
-    if (g_cachedProfileId != -1) return g_cachedProfileId;
+// --- Folder registry ---
 
-    char* profileName = GetCurrentProfile();
-    if (!profileName) {
-        g_cachedProfileId = 1;
-        return 1; 
-    }
+FolderRegistry::FolderRegistry()
+    : dataVersion(-1), loaded(false), profile(1), loads(0) {
+}
 
-    sqlite3_stmt* stmt;
-    const char* sql = "SELECT id FROM profiles WHERE name = ?";
-    int id = 1; // Default
+std::string FolderRegistry::key(int storageId, const std::string& name) {
+    return std::to_string(storageId) + ":" + name;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, profileName, -1, SQLITE_STATIC); // Имя профиля не меняется пока мы тут
+long long FolderRegistry::readDataVersion(sqlite3* db) {
+    // Per connection, and unchanged by that connection's own commits
+    long long version = -1;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt, nullptr) == SQLITE_OK) {
         if (sqlite3_step(stmt) == SQLITE_ROW) {
-            id = sqlite3_column_int(stmt, 0);
+            version = sqlite3_column_int64(stmt, 0);
         }
         sqlite3_finalize(stmt);
     }
+    return version;
+}
+
+void FolderRegistry::revalidate(sqlite3* db) {
+    if (!loaded) return;
+    
+    long long version = readDataVersion(db);
+    if (version == -1 || version != dataVersion) {
+        loaded = false;
+    }
+}
+
+bool FolderRegistry::load(sqlite3* db) {
+    // Read the version first: a commit racing the load only costs a reload
+    dataVersion = readDataVersion(db);
+    folders.clear();
     
-    if (profileName) free(profileName);
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT id, storageid, name FROM folders", -1, &stmt, nullptr) != SQLITE_OK) {
+        LOG_MSG("Folder registry: load failed: %s", sqlite3_errmsg(db));
+        return false;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = (const char*)sqlite3_column_text(stmt, 2);
+        folders[key(sqlite3_column_int(stmt, 1), name ? name : "")] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
     
-    g_cachedProfileId = id;
-    return id;
+    profile = lookupProfileId(db);
+    
+    loaded = true;
+    loads++;
+    LOG_MSG("Folder registry: loaded %d folders, profile %d (load #%d)",
+            (int)folders.size(), profile, loads);
+    return true;
+}
+
+int FolderRegistry::findFolder(sqlite3* db, int storageId, const std::string& name) {
+    if (!loaded && !load(db)) return -1;
+    
+    auto it = folders.find(key(storageId, name));
+    return it != folders.end() ? it->second : -1;
+}
+
+void FolderRegistry::addFolder(int storageId, const std::string& name, int folderId) {
+    if (loaded) folders[key(storageId, name)] = folderId;
+}
+
+int FolderRegistry::profileId(sqlite3* db) {
+    if (!loaded) load(db);
+    return profile;
+}
+
+// --- Folders & profile ---
+
+int BookManager::getCurrentProfileId(sqlite3* db) {
+    return folderRegistry.profileId(db);
 }
 
 int BookManager::getOrCreateFolder(sqlite3* db, const std::string& folderPath, int storageId) {
-    std::string cacheKey = std::to_string(storageId) + ":" + folderPath;
-    auto it = g_folderCache.find(cacheKey);
-    if (it != g_folderCache.end()) {
-        return it->second;
+    int folderId = folderRegistry.findFolder(db, storageId, folderPath);
+    if (folderId != -1) {
+        return folderId;
     }
 
-    int folderId = -1;
-
+    // Confirm the miss before inserting: the explorer may have added the
+    // folder since the registry was last revalidated
     const char* selectSql = "SELECT id FROM folders WHERE storageid = ? AND name = ?";
     sqlite3_stmt* stmt;
     
@@ -207,7 +559,7 @@ int BookManager::getOrCreateFolder(sqlite3* db, const std::string& folderPath, i
     }
 
     if (folderId != -1) {
-        g_folderCache[cacheKey] = folderId;
+        folderRegistry.addFolder(storageId, folderPath, folderId);
     }
     
     return folderId;
@@ -319,7 +671,7 @@ bool BookManager::addBook(const BookMetadata& metadata) {
     time_t fileMtime = fastParseIsoTime(metadata.lastModified);
     if (fileMtime == 0) fileMtime = time(NULL); // Fallback
 
-    sqlite3* db = openDB();
+    sqlite3* db = beginWrite();
     if (!db) return false;
 
     int storageId = getStorageId(fullPath);
@@ -329,13 +681,10 @@ bool BookManager::addBook(const BookMetadata& metadata) {
         currentBatchTimestamp = now;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-
     int folderId = getOrCreateFolder(db, folderName, storageId);
     if (folderId == -1) {
         LOG_MSG("Error: Failed to get folder ID");
-        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
-        closeDB(db);
+        endWrite(db, false);
         return false;
     }
 
@@ -443,35 +792,25 @@ bool BookManager::addBook(const BookMetadata& metadata) {
         processBookSettings(db, bookId, metadata, profileId);
     }
 
-    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-    
-    closeDB(db);
-    return true;
+    return endWrite(db, true);
 }
 
 bool BookManager::updateBookSync(const BookMetadata& metadata) {
-    sqlite3* db = openDB();
+    sqlite3* db = beginWrite();
     if (!db) return false;
 
-    // Пытаемся найти ID без транзакции для скорости
     int bookId = findBookIdByPath(db, metadata.lpath);
     
     if (bookId == -1) {
         LOG_MSG("Sync: Book not found in DB: %s", metadata.lpath.c_str());
-        closeDB(db);
+        endWrite(db, false);
         return false;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-
     int profileId = getCurrentProfileId(db);
     bool res = processBookSettings(db, bookId, metadata, profileId);
 
-    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-    // PRAGMA wal_checkpoint(FULL) тоже тяжелая операция, лучше доверить SQLite
-    
-    closeDB(db);
-    return res;
+    return endWrite(db, res);
 }
 
 bool BookManager::updateBook(const BookMetadata& metadata) {
@@ -484,7 +823,7 @@ bool BookManager::deleteBook(const std::string& lpath) {
     
     remove(filePath.c_str());
 
-    sqlite3* db = openDB();
+    sqlite3* db = beginWrite();
     if (!db) return false;
 
     std::string folderName, fileName;
@@ -499,8 +838,6 @@ bool BookManager::deleteBook(const std::string& lpath) {
     
     int storageId = getStorageId(filePath);
 
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-
     static const char* findSql = 
         "SELECT f.id, f.book_id FROM files f "
         "JOIN folders fo ON f.folder_id = fo.id "
@@ -545,86 +882,168 @@ bool BookManager::deleteBook(const std::string& lpath) {
         }
     }
 
-    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-    
-    closeDB(db);
-    return true;
+    return endWrite(db, true);
 }
 
-std::vector<BookMetadata> BookManager::getAllBooks() {
-    std::vector<BookMetadata> books;
-    books.reserve(2048);
-
-    sqlite3* db = openDB();
-    if (!db) return books;
+// --- Catalog Cursor ---
+
+static const char* CATALOG_COUNT_SQL =
+    "SELECT COUNT(*) FROM books_impl b "
+    "JOIN files f ON b.id = f.book_id "
+    "JOIN folders fo ON f.folder_id = fo.id "
+    "WHERE (?1 = 0 OR f.storageid = ?1)";
+
+static const char* CATALOG_ROWS_SQL =
+    "SELECT b.id, b.title, b.author, b.series, b.numinseries, b.size, f.modification_time, "
+    "f.filename, fo.name, bs.completed, bs.favorite, bs.completed_ts, f.storageid "
+    "FROM books_impl b "
+    "JOIN files f ON b.id = f.book_id "
+    "JOIN folders fo ON f.folder_id = fo.id "
+    "LEFT JOIN books_settings bs ON b.id = bs.bookid AND bs.profileid = ?2 "
+    "WHERE (?1 = 0 OR f.storageid = ?1)";
+
+static void assignColumnText(std::string& dst, sqlite3_stmt* stmt, int col) {
+    const char* text = (const char*)sqlite3_column_text(stmt, col);
+    if (text) {
+        dst.assign(text, sqlite3_column_bytes(stmt, col));
+    } else {
+        dst.clear();
+    }
+}
 
-    int profileId = getCurrentProfileId(db);
+BookCursor::BookCursor(BookManager* mgr, int storage)
+    : manager(mgr), db(nullptr), stmt(nullptr), storageId(storage), profileId(1), total(0),
+      ownsTransaction(false) {
+    db = manager->readDB();
+    if (!db) return;
+    
+    TimelineSpan span("catalog-count", "sqlite");
+    
+    // Deferred read transaction: the snapshot is taken by the COUNT below
+    // and shared with the row query. A cursor opened inside another read
+    // on the same connection shares that snapshot instead.
+    ownsTransaction = sqlite3_get_autocommit(db) != 0;
+    if (ownsTransaction) sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
     
-    static const char* sql = 
-		"SELECT b.id, b.title, b.author, b.series, b.numinseries, b.size, f.modification_time, "
-		"f.filename, fo.name, bs.completed, bs.favorite, bs.completed_ts "
-		"FROM books_impl b "
-		"JOIN files f ON b.id = f.book_id "
-		"JOIN folders fo ON f.folder_id = fo.id "
-		"LEFT JOIN books_settings bs ON b.id = bs.bookid AND bs.profileid = ?";
+    // The registry belongs to the writer thread; one indexed lookup here
+    profileId = lookupProfileId(db);
+    
+    sqlite3_stmt* countStmt;
+    if (sqlite3_prepare_v2(db, CATALOG_COUNT_SQL, -1, &countStmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_int(countStmt, 1, storageId);
+        if (sqlite3_step(countStmt) == SQLITE_ROW) {
+            total = sqlite3_column_int(countStmt, 0);
+        }
+        sqlite3_finalize(countStmt);
+    }
+}
 
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, profileId);
-        
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            BookMetadata meta;
-            meta.dbBookId = sqlite3_column_int(stmt, 0);
-            
-            const char* title = (const char*)sqlite3_column_text(stmt, 1);
-            const char* author = (const char*)sqlite3_column_text(stmt, 2);
-            const char* series = (const char*)sqlite3_column_text(stmt, 3);
-            
-            if (title) meta.title = title;
-            if (author) meta.authors = author;
-            if (series) meta.series = series;
-            
-            meta.seriesIndex = sqlite3_column_int(stmt, 4);
-            meta.size = sqlite3_column_int64(stmt, 5);
-            
-            const char* filename = (const char*)sqlite3_column_text(stmt, 7);
-            const char* folder = (const char*)sqlite3_column_text(stmt, 8);
-            
-            if (filename && folder) {
-                std::string fullPath = std::string(folder) + "/" + filename;
-                if (fullPath.compare(0, booksDir.length(), booksDir) == 0) {
-                     // Оптимизированный substr
-                    meta.lpath = fullPath.substr(booksDir.length());
-                    if (!meta.lpath.empty() && meta.lpath[0] == '/') {
-                        meta.lpath.erase(0, 1);
-                    }
-                } else {
-                    meta.lpath = filename;
-                }
-            }
-            
-            meta.isRead = (sqlite3_column_int(stmt, 9) != 0);
-            meta.isFavorite = (sqlite3_column_int(stmt, 10) != 0);
-            
-            time_t readTs = (time_t)sqlite3_column_int64(stmt, 11);
-            if (meta.isRead && readTs > 0) {
-                meta.lastReadDate = formatIsoTime(readTs);
-            }
-            
-            time_t fileMtime = (time_t)sqlite3_column_int64(stmt, 6);
-			meta.lastModified = formatIsoTime(fileMtime);
+BookCursor::~BookCursor() {
+    if (stmt) sqlite3_finalize(stmt);
+    if (db && ownsTransaction) {
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+}
 
-            books.push_back(std::move(meta));
+bool BookCursor::next(BookMetadata& meta) {
+    if (!db) return false;
+    
+    // Row query is prepared lazily so count-only users pay for one statement
+    if (!stmt) {
+        if (sqlite3_prepare_v2(db, CATALOG_ROWS_SQL, -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_MSG("Catalog query failed: %s", sqlite3_errmsg(db));
+            stmt = nullptr;
+            return false;
         }
-        sqlite3_finalize(stmt);
+        sqlite3_bind_int(stmt, 1, storageId);
+        sqlite3_bind_int(stmt, 2, profileId);
     }
     
-    closeDB(db);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        return false;
+    }
+    
+    meta.uuid.clear();
+    meta.dbBookId = sqlite3_column_int(stmt, 0);
+    assignColumnText(meta.title, stmt, 1);
+    assignColumnText(meta.authors, stmt, 2);
+    assignColumnText(meta.series, stmt, 3);
+    meta.seriesIndex = sqlite3_column_int(stmt, 4);
+    meta.size = sqlite3_column_int64(stmt, 5);
+    
+    // lpath is the path relative to the storage root the file lives on
+    const char* filename = (const char*)sqlite3_column_text(stmt, 7);
+    const char* folder = (const char*)sqlite3_column_text(stmt, 8);
+    meta.lpath.clear();
+    if (filename && folder) {
+        const std::string& root = manager->storageRoot(sqlite3_column_int(stmt, 12));
+        if (isUnderRoot(folder, root)) {
+            const char* rel = folder + root.size();
+            if (*rel == '/') rel++;
+            meta.lpath.assign(rel);
+            if (!meta.lpath.empty()) meta.lpath += '/';
+            meta.lpath += filename;
+        } else {
+            meta.lpath.assign(filename);
+        }
+    }
+    
+    meta.isRead = (sqlite3_column_int(stmt, 9) != 0);
+    meta.isFavorite = (sqlite3_column_int(stmt, 10) != 0);
+    
+    time_t readTs = (time_t)sqlite3_column_int64(stmt, 11);
+    if (meta.isRead && readTs > 0) {
+        meta.lastReadDate = formatIsoTime(readTs);
+    } else {
+        meta.lastReadDate.clear();
+    }
+    
+    time_t fileMtime = (time_t)sqlite3_column_int64(stmt, 6);
+    meta.lastModified = formatIsoTime(fileMtime);
+    
+    return true;
+}
+
+int BookManager::storageIdForCard(const std::string& onCard) {
+    if (onCard.empty() || onCard == "main") return STORAGE_MAIN;
+    if (onCard == "carda") return STORAGE_CARD;
+    return -1;
+}
+
+const std::string& BookManager::storageRoot(int storageId) const {
+    return (storageId == STORAGE_CARD) ? cardDir : mainDir;
+}
+
+int BookManager::forEachBook(int storageId, const std::function<bool(const BookMetadata&)>& visitor) {
+    TimelineSpan span("forEachBook", "sqlite");
+    BookCursor cursor(this, storageId);
+    BookMetadata meta;
+    int visited = 0;
+    
+    while (cursor.next(meta)) {
+        visited++;
+        if (!visitor(meta)) break;
+    }
+    return visited;
+}
+
+std::vector<BookMetadata> BookManager::getAllBooks() {
+    TimelineSpan span("getAllBooks", "sqlite");
+    std::vector<BookMetadata> books;
+    
+    BookCursor cursor(this, STORAGE_ANY);
+    books.reserve(cursor.count());
+    
+    BookMetadata meta;
+    while (cursor.next(meta)) {
+        books.push_back(meta);
+    }
     return books;
 }
 
 int BookManager::getBookCount() {
-    return getAllBooks().size();
+    BookCursor cursor(this, STORAGE_ANY);
+    return cursor.count();
 }
 
 int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
@@ -655,72 +1074,38 @@ int BookManager::findBookIdByPath(sqlite3* db, const std::string& lpath) {
     return bookId;
 }
 
-int BookManager::getOrCreateBookshelf(sqlite3* db, const std::string& name) {
-    int shelfId = -1;
-    time_t now = time(NULL);
+bool BookIdResolver::load(sqlite3* db) {
+    ids.clear();
+    
+    static const char* sql =
+        "SELECT fo.name, f.filename, f.book_id FROM files f "
+        "JOIN folders fo ON f.folder_id = fo.id";
     
-    static const char* findSql = "SELECT id FROM bookshelfs WHERE name = ?";
     sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, findSql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            shelfId = sqlite3_column_int(stmt, 0);
-            static const char* restoreSql = "UPDATE bookshelfs SET is_deleted = 0, ts = ? WHERE id = ?";
-            sqlite3_stmt* stmt2;
-            if (sqlite3_prepare_v2(db, restoreSql, -1, &stmt2, nullptr) == SQLITE_OK) {
-                sqlite3_bind_int64(stmt2, 1, now);
-                sqlite3_bind_int(stmt2, 2, shelfId);
-                sqlite3_step(stmt2);
-                sqlite3_finalize(stmt2);
-            }
-        }
-        sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        LOG_MSG("Resolver: failed to prepare scan: %s", sqlite3_errmsg(db));
+        return false;
     }
     
-    if (shelfId == -1) {
-        static const char* insertSql = "INSERT INTO bookshelfs (name, is_deleted, ts) VALUES (?, 0, ?)";
-        if (sqlite3_prepare_v2(db, insertSql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_int64(stmt, 2, now);
-            if (sqlite3_step(stmt) == SQLITE_DONE) {
-                shelfId = (int)sqlite3_last_insert_rowid(db);
-            }
-            sqlite3_finalize(stmt);
-        }
+    std::string key;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* folder = (const char*)sqlite3_column_text(stmt, 0);
+        const char* filename = (const char*)sqlite3_column_text(stmt, 1);
+        if (!folder || !filename) continue;
+        
+        key.assign(folder);
+        key += '/';
+        key += filename;
+        // First match wins, as with findBookIdByPath
+        ids.emplace(key, sqlite3_column_int(stmt, 2));
     }
-    return shelfId;
+    sqlite3_finalize(stmt);
+    
+    LOG_MSG("Resolver: loaded %d file paths", (int)ids.size());
+    return true;
 }
 
-void BookManager::linkBookToShelf(sqlite3* db, int shelfId, int bookId) {
-    time_t now = time(NULL);
-    
-    static const char* checkSql = "SELECT 1 FROM bookshelfs_books WHERE bookshelfid = ? AND bookid = ?";
-    bool exists = false;
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, checkSql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, shelfId);
-        sqlite3_bind_int(stmt, 2, bookId);
-        if (sqlite3_step(stmt) == SQLITE_ROW) exists = true;
-        sqlite3_finalize(stmt);
-    }
-    
-    if (exists) {
-        static const char* updateSql = "UPDATE bookshelfs_books SET is_deleted = 0, ts = ? WHERE bookshelfid = ? AND bookid = ?";
-        if (sqlite3_prepare_v2(db, updateSql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_int64(stmt, 1, now);
-            sqlite3_bind_int(stmt, 2, shelfId);
-            sqlite3_bind_int(stmt, 3, bookId);
-            sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
-        }
-    } else {
-        static const char* insertSql = "INSERT INTO bookshelfs_books (bookshelfid, bookid, ts, is_deleted) VALUES (?, ?, ?, 0)";
-        if (sqlite3_prepare_v2(db, insertSql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_int(stmt, 1, shelfId);
-            sqlite3_bind_int(stmt, 2, bookId);
-            sqlite3_bind_int64(stmt, 3, now);
-            sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
-        }
-    }
+int BookIdResolver::resolve(const std::string& lpath) const {
+    std::unordered_map<std::string, int>::const_iterator it = ids.find(manager->getBookFilePath(lpath));
+    return (it != ids.end()) ? it->second : -1;
 }
@@ -5,8 +5,12 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <sqlite3.h>
 #include <ctime>
+#include <functional>
+#include <memory>
+#include <utility>
 
 struct BookMetadata {
     std::string uuid;
@@ -38,12 +42,118 @@ struct BookMetadata {
                      thumbnailWidth(0), isRead(false), isFavorite(false), dbBookId(-1) {}
 };
 
+// Calibre collections as sent with SEND_BOOKLISTS: name -> member lpaths
+typedef std::vector<std::pair<std::string, std::vector<std::string> > > CollectionList;
+
+// Values of the explorer-3 `files.storageid` column
+enum StorageId {
+    STORAGE_ANY  = 0, // Cursor filter only: no storage restriction
+    STORAGE_MAIN = 1, // Internal memory (FLASHDIR)
+    STORAGE_CARD = 2  // SD card (SDCARDDIR)
+};
+
+class BookManager;
+class SqlProfiler;
+
+// Forward-only cursor over the device catalog.
+// Holds a read transaction for its lifetime, so count() and the rows
+// returned by next() come from the same snapshot of the database.
+class BookCursor {
+public:
+    BookCursor(BookManager* manager, int storageId);
+    ~BookCursor();
+    
+    bool isOpen() const { return db != nullptr; }
+    
+    // Number of rows the cursor will yield
+    int count() const { return total; }
+    
+    // Decodes the next row into `meta`, reusing its string buffers.
+    // Returns false when the result set is exhausted.
+    bool next(BookMetadata& meta);
+    
+private:
+    BookManager* manager;
+    sqlite3* db;
+    sqlite3_stmt* stmt;
+    int storageId;
+    int profileId;
+    int total;
+    bool ownsTransaction;
+    
+    BookCursor(const BookCursor&);
+    BookCursor& operator=(const BookCursor&);
+};
+
+// Resolves Calibre lpaths to explorer-3 book ids.
+// load() reads the whole (folder, filename) -> book_id mapping in a single
+// scan, so bulk operations such as collection sync avoid a query per lpath.
+class BookIdResolver {
+public:
+    explicit BookIdResolver(BookManager* manager) : manager(manager) {}
+    
+    bool load(sqlite3* db);
+    
+    // Returns the book id for an lpath, or -1 if the file is not in the DB
+    int resolve(const std::string& lpath) const;
+    
+    size_t size() const { return ids.size(); }
+    
+private:
+    BookManager* manager;
+    std::unordered_map<std::string, int> ids; // Full file path -> book id
+};
+
+// Session copy of the explorer-3 `folders` table and the current profile id.
+// The whole table is read in one query and every lookup is then served from
+// memory. revalidate() compares PRAGMA data_version on the writer
+// connection, so folders added by the PocketBook explorer (or by any other
+// connection) cause a reload before the next batch.
+// Only used from the thread that owns the writer connection.
+class FolderRegistry {
+public:
+    FolderRegistry();
+    
+    // Drops the cached state if another connection committed since the
+    // load. `db` must be the connection the registry was loaded through.
+    void revalidate(sqlite3* db);
+    
+    // Forces a reload on the next lookup (e.g. after a rolled-back insert)
+    void invalidate() { loaded = false; }
+    
+    // Returns the folder id, or -1 if the folder is not registered.
+    // Loads through `db` first if needed, so uncommitted rows are visible.
+    int findFolder(sqlite3* db, int storageId, const std::string& name);
+    void addFolder(int storageId, const std::string& name, int folderId);
+    
+    int profileId(sqlite3* db);
+    
+private:
+    long long dataVersion;
+    bool loaded;
+    int profile;
+    int loads;
+    std::unordered_map<std::string, int> folders; // "storage:name" -> id
+    
+    bool load(sqlite3* db);
+    static long long readDataVersion(sqlite3* db);
+    static std::string key(int storageId, const std::string& name);
+    
+    FolderRegistry(const FolderRegistry&);
+    FolderRegistry& operator=(const FolderRegistry&);
+};
+
 class BookManager {
 public:
     BookManager();
     ~BookManager();
     
-    bool initialize(const std::string& ignored_path);
+    // `dbPath` replaces the system explorer-3.db when not empty
+    bool initialize(const std::string& dbPath);
+    
+    // Stores books under these directories instead of FLASHDIR and
+    // SDCARDDIR (session replays run against scratch storage)
+    void redirectStorage(const std::string& mainRoot, const std::string& cardRoot);
     
     bool addBook(const BookMetadata& metadata);
     
@@ -55,14 +165,62 @@ public:
     
     std::vector<BookMetadata> getAllBooks(); 
     int getBookCount();
+    
+    // Streams every book on the given storage to `visitor` without building
+    // a list. The visitor returns false to stop early. Returns rows visited.
+    int forEachBook(int storageId, const std::function<bool(const BookMetadata&)>& visitor);
+    
+    // Maps a Calibre `on_card` value ("", "main", "carda") to a storage id.
+    // Returns -1 for locations this device does not have.
+    static int storageIdForCard(const std::string& onCard);
+    // Root directory of a storage, following redirectStorage()
+    const std::string& storageRoot(int storageId) const;
     std::string getBookFilePath(const std::string& lpath);
     
-    // Public methods for collection management (used by CalibreProtocol)
+    // Copies committed WAL frames back into the main database file
+    bool checkpoint();
+    
+    // Statement profiling for connections opened after it is enabled.
+    // writeSqlProfile() dumps the report next to the log and starts over.
+    void enableSqlProfiling(bool enabled);
+    void writeSqlProfile();
+    
+    // Group-commit ingestion. While a batch is open, book writes share one
+    // transaction on a persistent connection that is committed every
+    // `maxBooks` books or `maxSeconds` seconds, so a crash loses at most
+    // one group.
+    void beginIngestBatch(int maxBooks, int maxSeconds);
+    // False if the last group failed to commit
+    bool endIngestBatch();
+    bool isIngestBatchActive() const { return batchActive; }
+    
+    // Writes in an open group are not durable yet; once it closes,
+    // lastIngestGroupCommitted() tells whether they were kept
+    bool isIngestGroupOpen() const { return groupOpen; }
+    bool lastIngestGroupCommitted() const { return lastGroupCommitted; }
+    
+    // Commits the open group regardless of its size or age; called when
+    // the connection goes idle. False if the commit failed.
+    bool flushIngestGroup();
+    
+    // Mirrors Calibre collections onto bookshelves in one transaction
+    bool syncCollections(const CollectionList& collections);
+    
+    // Commits any open group and closes the writer connection. Writes
+    // reopen it on demand.
+    void closeWriter();
+    
+    // Opens a read-write connection to the library database with the
+    // busy handling every connection here uses
     sqlite3* openDB();
     void closeDB(sqlite3* db);
-    int getOrCreateBookshelf(sqlite3* db, const std::string& name);
+    
+    // Session-long read-only connection with a large page cache and mmap,
+    // for catalog scans. It reads a WAL snapshot, so it never waits on an
+    // open ingest group. Wrap multi-statement reads in BEGIN/COMMIT.
+    sqlite3* readDB();
+    
     int findBookIdByPath(sqlite3* db, const std::string& lpath);
-    void linkBookToShelf(sqlite3* db, int shelfId, int bookId);
 	
 	bool hasSDCard() const;
 	std::string getSDCardPath() const;
@@ -71,10 +229,47 @@ public:
 
 private:
     const std::string SYSTEM_DB_PATH = "/mnt/ext1/system/explorer-3/explorer-3.db";
+    const std::string SQL_PROFILE_PATH = "/mnt/ext1/system/calibre-connect-sql.log";
+    static const int BUSY_TIMEOUT_MS = 5000;
+    static const int READ_CACHE_KB = 8192;
+    static const long long READ_MMAP_BYTES = 32LL * 1024 * 1024;
+    std::string databasePath;
+    std::string mainDir;
+    std::string cardDir;
     std::string booksDir;
 	
 	time_t currentBatchTimestamp;
     
+    std::unique_ptr<SqlProfiler> profiler;
+    sqlite3* readDb;
+    FolderRegistry folderRegistry;
+    
+    // Ingest batch state
+    sqlite3* writeDb;
+    bool batchActive;
+    int batchMaxBooks;
+    int batchMaxSeconds;
+    bool groupOpen;
+    bool lastGroupCommitted;
+    int groupBooks;
+    time_t groupStarted;
+    int batchBooks;
+    int batchCommits;
+    
+    // Every write runs on one long-lived connection, so it never contends
+    // with an open ingest group. Outside a batch each call is its own
+    // BEGIN/COMMIT; inside a batch it is a savepoint in the current group.
+    // All of these, and the folder registry, belong to the writer thread.
+    sqlite3* writerDB();
+    sqlite3* beginWrite();
+    // False when the write did not stick: it failed, or its commit did
+    bool endWrite(sqlite3* db, bool success);
+    bool commitGroup();
+    void discardGroup();
+    
+    void setBusyHandling(sqlite3* db);
+    void closeReadDB();
+    
     int getStorageId(const std::string& filename);
     int getCurrentProfileId(sqlite3* db);
     std::string getFirstLetter(const std::string& str);
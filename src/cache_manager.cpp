@@ -1,4 +1,6 @@
 #include "cache_manager.h"
+#include "logger.h"
+#include "timeline.h"
 #include <json-c/json.h>
 #include <ctime>
 #include <cstdio>
@@ -6,24 +8,283 @@
 #include <algorithm>
 #include <cstring>
 #include <unistd.h> // Для fsync, unlink, rename
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <cstddef>
 
-// Оптимизация логгера: добавлен fflush и проверка указателя
-#define LOG_CACHE(fmt, ...) { \
-    FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a"); \
-    if(f) { \
-        fprintf(f, "[CACHE] " fmt "\n", ##__VA_ARGS__); \
-        fflush(f); \
-        fclose(f); \
-    } \
+#define LOG_CACHE(...) LOG_AT(LOG_INFO, "CACHE", __VA_ARGS__)
+
+// --- Binary file layout ---
+//
+// All fields are native-endian 32-bit values; the file is only ever read
+// on the device that wrote it. String fields are offsets into the string
+// table, where offset 0 is the empty string. Version 1 files have no
+// library table; their entries form the unassigned partition.
+
+static const char CACHE_MAGIC[4] = { 'C', 'C', 'B', 'C' };
+static const uint32_t CACHE_VERSION = 2;
+static const size_t LEGACY_MAX_SIZE = 50 * 1024 * 1024;
+
+// Journal: magic and version, then records of
+//   u32 payload size | u32 FNV-1a of payload | payload
+// A record that is cut short or fails its checksum ends the replay.
+// Version 2 payloads carry the library UUID after the record type.
+static const char JOURNAL_MAGIC[4] = { 'C', 'C', 'B', 'J' };
+static const uint32_t JOURNAL_VERSION = 2;
+static const long JOURNAL_HEADER_BYTES = 8;
+
+enum JournalRecordType {
+    JOURNAL_UPDATE = 1,
+    JOURNAL_REMOVE = 2,
+    JOURNAL_CLEAR = 3,
+    JOURNAL_ADOPT = 4   // Library takes over the unassigned partition
+};
+
+enum CacheEntryFlags {
+    CACHE_FLAG_READ = 1,
+    CACHE_FLAG_FAVORITE = 2,
+    CACHE_FLAG_STORED = CACHE_FLAG_READ | CACHE_FLAG_FAVORITE,
+    CACHE_FLAG_PRESENT = 0x100  // In memory only: listed this session
+};
+
+struct CacheFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t entriesOffset;
+    uint32_t stringsOffset;
+    uint32_t stringsSize;
+    // Version 2
+    uint32_t libraryCount;
+    uint32_t librariesOffset;
+};
+
+static const size_t CACHE_V1_HEADER_SIZE = offsetof(CacheFileHeader, libraryCount);
+
+struct CacheFileLibrary {
+    uint32_t uuid;          // String offset
+    uint32_t indexOffset;   // File offset of indexCount u32 pool indices
+    uint32_t indexCount;
+};
+
+struct CacheFileEntry {
+    uint32_t lpath;
+    uint32_t uuid;
+    uint32_t title;
+    uint32_t authors;
+    uint32_t lastModified;
+    uint32_t lastReadDate;
+    uint32_t lastUsed; // Unix time
+    uint32_t flags;
+};
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long residentKb() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static uint32_t fnv1a(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void putU32(std::string& out, uint32_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void putString(std::string& out, const std::string& str) {
+    putU32(out, (uint32_t)str.size());
+    out.append(str);
+}
+
+// Bounds-checked decoder for one journal payload
+class JournalReader {
+public:
+    JournalReader(const char* data, size_t size) : pos(data), end(data + size), ok(true) {}
+    
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (end - pos < (long)sizeof(value)) { ok = false; return 0; }
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+    std::string str() {
+        uint32_t size = u32();
+        if (!ok || (size_t)(end - pos) < size) { ok = false; return ""; }
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+    bool good() const { return ok; }
+    
+private:
+    const char* pos;
+    const char* end;
+    bool ok;
+};
+
+// Deduplicating string table builder for compact()
+class StringTableWriter {
+public:
+    StringTableWriter() : data(1, '\0') {}
+    
+    uint32_t add(const char* str) {
+        if (!str || !*str) return 0;
+        auto it = offsets.find(str);
+        if (it != offsets.end()) return it->second;
+        
+        uint32_t offset = (uint32_t)data.size();
+        data.insert(data.end(), str, str + strlen(str) + 1);
+        offsets.emplace(str, offset);
+        return offset;
+    }
+    uint32_t add(const std::string& str) { return add(str.c_str()); }
+    
+    const std::vector<char>& bytes() const { return data; }
+    
+private:
+    std::vector<char> data;
+    std::unordered_map<std::string, uint32_t> offsets;
+};
+
+uint32_t StringArena::add(const std::string& str) {
+    if (str.empty()) return 0;
+    uint32_t offset = (uint32_t)data.size();
+    data.insert(data.end(), str.c_str(), str.c_str() + str.size() + 1);
+    return offset;
+}
+
+void StringArena::clear() {
+    data.assign(1, '\0');
+    data.shrink_to_fit();
 }
 
-CacheManager::CacheManager() {
+CacheManager::CacheManager()
+    : mapBase(nullptr), mapSize(0), fileEntries(nullptr), fileEntryCount(0),
+      fileStrings(nullptr), active(nullptr), listed(false), dirty(false),
+      journal(nullptr), journalBytes(0), loading(false) {
+    resetPartitions();
+    resetSessionStats();
 }
 
 CacheManager::~CacheManager() {
+    finishLoader();
+    closeJournal();
+    unmapFile();
 }
 
 bool CacheManager::initialize(const std::string& deviceUuid) {
+    finishLoader();
+    {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        requestedUuid = deviceUuid;
+    }
+    return load(deviceUuid);
+}
+
+void CacheManager::initializeAsync(const std::string& deviceUuid) {
+    if (deviceUuid.empty()) return;
+    
+    {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        if (deviceUuid == requestedUuid) return;
+    }
+    finishLoader();
+    
+    std::lock_guard<std::mutex> lock(loadMutex);
+    requestedUuid = deviceUuid;
+    loading = true;
+    try {
+        loader = std::thread([this, deviceUuid]() {
+            Timeline::instance().setThreadName("cache-load");
+            {
+                TimelineSpan span("cache-load", "file");
+                load(deviceUuid);
+            }
+            std::lock_guard<std::mutex> done(loadMutex);
+            loading = false;
+            loadDone.notify_all();
+        });
+    } catch (const std::system_error&) {
+        // No thread available: the first caller to need the cache loads it
+        loading = false;
+        requestedUuid.clear();
+        LOG_CACHE("Cannot start cache loader thread");
+    }
+}
+
+void CacheManager::waitForLoad() const {
+    if (!loading) return;
+    
+    std::unique_lock<std::mutex> lock(loadMutex);
+    loadDone.wait(lock, [this]() { return !loading; });
+}
+
+void CacheManager::finishLoader() {
+    waitForLoad();
+    if (loader.joinable()) loader.join();
+}
+
+void CacheManager::selectLibrary(const std::string& libraryUuid) {
+    waitForLoad();
+    
+    if (libraryUuid == activeLibrary) return;
+    
+    // The first library seen takes over what was cached before libraries
+    // were told apart
+    if (!libraryUuid.empty() && partition(libraryUuid).liveCount == 0 &&
+        partition("").liveCount > 0) {
+        std::string record;
+        putU32(record, JOURNAL_ADOPT);
+        putString(record, libraryUuid);
+        appendRecord(record);
+        
+        applyAdopt(libraryUuid);
+        LOG_CACHE("Library %s adopted the unassigned cache entries", libraryUuid.c_str());
+    }
+    
+    activeLibrary = libraryUuid;
+    active = &partition(libraryUuid);
+    LOG_CACHE("Selected library %s: %d cached entries",
+              libraryUuid.c_str(), (int)active->liveCount);
+}
+
+CacheManager::Partition& CacheManager::partition(const std::string& libraryUuid) {
+    return partitions[libraryUuid];
+}
+
+void CacheManager::resetPartitions() {
+    partitions.clear();
+    arena.clear();
+    listed = false;
+    activeLibrary.clear();
+    active = &partition("");
+}
+
+size_t CacheManager::totalCount() const {
+    size_t count = 0;
+    for (const auto& item : partitions) {
+        count += item.second.liveCount;
+    }
+    return count;
+}
+
+bool CacheManager::load(const std::string& deviceUuid) {
     if (deviceUuid.empty()) {
         LOG_CACHE("Cannot initialize: empty device UUID");
         return false;
@@ -31,21 +292,21 @@ bool CacheManager::initialize(const std::string& deviceUuid) {
     
     this->deviceUuid = deviceUuid;
     // Формируем путь. Можно вынести базовый путь в константу.
-    cacheFilePath = "/mnt/ext1/system/calibre_cache_" + deviceUuid + ".json";
+    cacheFilePath = "/mnt/ext1/system/calibre_cache_" + deviceUuid + ".bin";
+    journalFilePath = "/mnt/ext1/system/calibre_cache_" + deviceUuid + ".jnl";
+    legacyFilePath = "/mnt/ext1/system/calibre_cache_" + deviceUuid + ".json";
+    
+    closeJournal();
+    unmapFile();
+    resetPartitions();
+    dirty = false;
+    journalBytes = 0;
     
     LOG_CACHE("Initialized cache for device: %s", deviceUuid.c_str());
     
     return loadCache();
 }
 
-std::string CacheManager::getCurrentTimestamp() const {
-    time_t now = time(NULL);
-    struct tm* tm_info = gmtime(&now);
-    char buffer[32];
-    // Оптимизация: использование фиксированного формата быстрее чем сложный strftime, но оставим для надежности
-    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S+00:00", tm_info);
-    return std::string(buffer);
-}
 
 time_t CacheManager::parseTimestamp(const std::string& isoTime) const {
     if (isoTime.empty()) return 0;
@@ -69,20 +330,229 @@ time_t CacheManager::parseTimestamp(const std::string& isoTime) const {
 }
 
 bool CacheManager::loadCache() {
-    FILE* f = fopen(cacheFilePath.c_str(), "r");
+    long long start = monotonicMs();
+    
+    // First run after an upgrade: convert the JSON cache once
+    if (!mapFile() && loadLegacyJson()) {
+        LOG_CACHE("Parsed JSON cache (%d entries) in %lld ms (RSS %ld KB)",
+                  (int)totalCount(), monotonicMs() - start, residentKb());
+        
+        if (compact()) {
+            unlink(legacyFilePath.c_str());
+            LOG_CACHE("Migrated JSON cache to %s", cacheFilePath.c_str());
+        }
+        return true;
+    }
+    
+    int replayed = replayJournal();
+    
+    LOG_CACHE("Loaded %d entries in %d libraries (%u in file pool, %d journal records) in %lld ms (RSS %ld KB)",
+              (int)totalCount(), (int)partitions.size(), fileEntryCount, replayed,
+              monotonicMs() - start, residentKb());
+    return true;
+}
+
+bool CacheManager::mapFile() {
+    int fd = open(cacheFilePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)CACHE_V1_HEADER_SIZE) {
+        close(fd);
+        LOG_CACHE("Binary cache too small, ignoring");
+        return false;
+    }
+    
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG_CACHE("Failed to map binary cache");
+        return false;
+    }
+    
+    const char* bytes = (const char*)base;
+    size_t size = (size_t)st.st_size;
+    const CacheFileHeader* header = (const CacheFileHeader*)bytes;
+    
+    // Offsets are checked against the file size so a truncated file is
+    // rejected instead of read past its end. Sums are taken in 64 bits:
+    // size_t is 32 bits on the device and would wrap.
+    bool valid = memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+                 (header->version == 1 ||
+                  (header->version == CACHE_VERSION && size >= sizeof(CacheFileHeader))) &&
+                 header->entriesOffset >= (header->version == 1 ? CACHE_V1_HEADER_SIZE : sizeof(CacheFileHeader)) &&
+                 header->entriesOffset % sizeof(uint32_t) == 0 &&
+                 header->entriesOffset + (uint64_t)header->entryCount * sizeof(CacheFileEntry) <= header->stringsOffset &&
+                 header->stringsSize > 0 &&
+                 (uint64_t)header->stringsOffset + header->stringsSize <= size &&
+                 bytes[header->stringsOffset + header->stringsSize - 1] == '\0';
+    
+    // Every string offset must land in the table, whose last byte is a NUL,
+    // so lookups never read past the mapping
+    const CacheFileEntry* entries = (const CacheFileEntry*)(bytes + header->entriesOffset);
+    for (uint32_t i = 0; valid && i < header->entryCount; i++) {
+        const CacheFileEntry& entry = entries[i];
+        valid = entry.lpath < header->stringsSize && entry.uuid < header->stringsSize &&
+                entry.title < header->stringsSize && entry.authors < header->stringsSize &&
+                entry.lastModified < header->stringsSize && entry.lastReadDate < header->stringsSize;
+    }
+    if (!valid) {
+        munmap(base, size);
+        LOG_CACHE("Binary cache has an unknown version or is damaged, ignoring");
+        return false;
+    }
+    
+    if (valid && header->version == CACHE_VERSION) {
+        valid = header->librariesOffset >= sizeof(CacheFileHeader) &&
+                header->librariesOffset % sizeof(uint32_t) == 0 &&
+                header->librariesOffset + (uint64_t)header->libraryCount * sizeof(CacheFileLibrary) <= size;
+        const CacheFileLibrary* libraries = (const CacheFileLibrary*)(bytes + header->librariesOffset);
+        for (uint32_t i = 0; valid && i < header->libraryCount; i++) {
+            const CacheFileLibrary& lib = libraries[i];
+            valid = lib.uuid < header->stringsSize && lib.indexOffset % sizeof(uint32_t) == 0 &&
+                    lib.indexOffset + (uint64_t)lib.indexCount * sizeof(uint32_t) <= size;
+            const uint32_t* index = (const uint32_t*)(bytes + lib.indexOffset);
+            for (uint32_t j = 0; valid && j < lib.indexCount; j++) {
+                valid = index[j] < header->entryCount;
+            }
+        }
+    }
+    if (!valid) {
+        munmap(base, size);
+        LOG_CACHE("Binary cache library table is damaged, ignoring");
+        return false;
+    }
+    
+    mapBase = base;
+    mapSize = size;
+    fileEntries = (const CacheFileEntry*)(bytes + header->entriesOffset);
+    fileEntryCount = header->entryCount;
+    fileStrings = bytes + header->stringsOffset;
+    
+    if (header->version == 1) {
+        Partition& part = partition("");
+        part.index = nullptr;
+        part.indexCount = fileEntryCount;
+        part.liveCount = fileEntryCount;
+        return true;
+    }
+    
+    const CacheFileLibrary* libraries = (const CacheFileLibrary*)(bytes + header->librariesOffset);
+    for (uint32_t i = 0; i < header->libraryCount; i++) {
+        Partition& part = partition(fileStrings + libraries[i].uuid);
+        part.index = (const uint32_t*)(bytes + libraries[i].indexOffset);
+        part.indexCount = libraries[i].indexCount;
+        part.liveCount = part.indexCount;
+    }
+    return true;
+}
+
+void CacheManager::unmapFile() {
+    if (mapBase) {
+        munmap(mapBase, mapSize);
+    }
+    mapBase = nullptr;
+    mapSize = 0;
+    fileEntries = nullptr;
+    fileEntryCount = 0;
+    fileStrings = nullptr;
+}
+
+const CacheFileEntry& CacheManager::fileEntry(const Partition& part, uint32_t i) const {
+    return fileEntries[part.index ? part.index[i] : i];
+}
+
+bool CacheManager::findPosition(const Partition& part, const std::string& lpath, uint32_t& position) const {
+    uint32_t lo = 0, hi = part.indexCount;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(fileStrings + fileEntry(part, mid).lpath, lpath.c_str());
+        if (cmp == 0) {
+            position = mid;
+            return true;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+const CacheFileEntry* CacheManager::findInFile(const Partition& part, const std::string& lpath) const {
+    uint32_t position;
+    if (!findPosition(part, lpath, position) || part.removed.count(lpath)) return nullptr;
+    return &fileEntry(part, position);
+}
+
+bool CacheManager::contains(const Partition& part, const std::string& lpath) const {
+    return part.overlay.count(lpath) > 0 || findInFile(part, lpath) != nullptr;
+}
+
+void CacheManager::readFileEntry(const CacheFileEntry& entry, BookMetadata& out) const {
+    out.lpath = fileStrings + entry.lpath;
+    out.uuid = fileStrings + entry.uuid;
+    out.title = fileStrings + entry.title;
+    out.authors = fileStrings + entry.authors;
+    out.lastModified = fileStrings + entry.lastModified;
+    out.lastReadDate = fileStrings + entry.lastReadDate;
+    out.isRead = (entry.flags & CACHE_FLAG_READ) != 0;
+    out.isFavorite = (entry.flags & CACHE_FLAG_FAVORITE) != 0;
+}
+
+void CacheManager::readEntry(const std::string& lpath, const CacheEntry& entry, BookMetadata& out) const {
+    out.lpath = lpath;
+    out.uuid = arena.get(entry.uuid);
+    out.title = arena.get(entry.title);
+    out.authors = arena.get(entry.authors);
+    out.lastModified = arena.get(entry.lastModified);
+    out.lastReadDate = arena.get(entry.lastReadDate);
+    out.isRead = (entry.flags & CACHE_FLAG_READ) != 0;
+    out.isFavorite = (entry.flags & CACHE_FLAG_FAVORITE) != 0;
+}
+
+CacheEntry CacheManager::makeEntry(const BookMetadata& metadata, time_t lastUsed) {
+    CacheEntry entry;
+    entry.uuid = arena.add(metadata.uuid);
+    entry.title = arena.add(metadata.title);
+    entry.authors = arena.add(metadata.authors);
+    entry.lastModified = arena.add(metadata.lastModified);
+    entry.lastReadDate = arena.add(metadata.lastReadDate);
+    entry.lastUsed = (uint32_t)lastUsed;
+    entry.flags = (metadata.isRead ? CACHE_FLAG_READ : 0) | (metadata.isFavorite ? CACHE_FLAG_FAVORITE : 0);
+    return entry;
+}
+
+size_t CacheManager::overlayBytes() const {
+    // Hash node: next pointer, cached hash, key and value, plus the bucket
+    // slot; keys too long for the small-string buffer add their own block
+    size_t bytes = arena.bytes();
+    for (const auto& item : partitions) {
+        const Partition& part = item.second;
+        bytes += part.overlay.bucket_count() * sizeof(void*);
+        for (const auto& entry : part.overlay) {
+            bytes += 2 * sizeof(void*) + sizeof(entry);
+            if (entry.first.capacity() > 15) bytes += entry.first.capacity() + 1;
+        }
+    }
+    return bytes;
+}
+
+bool CacheManager::loadLegacyJson() {
+    FILE* f = fopen(legacyFilePath.c_str(), "r");
     if (!f) {
         LOG_CACHE("Cache file not found, starting fresh");
-        return true;
+        return false;
     }
     
     fseek(f, 0, SEEK_END);
     long fileSize = ftell(f);
     fseek(f, 0, SEEK_SET);
     
-    if (fileSize <= 0 || fileSize > 50 * 1024 * 1024) { // 50MB limit
+    if (fileSize <= 0 || (size_t)fileSize > LEGACY_MAX_SIZE) {
         fclose(f);
         LOG_CACHE("Invalid cache file size: %ld", fileSize);
-        return true;
+        return false;
     }
     
     std::vector<char> buffer(fileSize + 1);
@@ -103,6 +573,7 @@ bool CacheManager::loadCache() {
     }
     
     int loaded = 0;
+    Partition& legacy = partition(""); // The JSON cache predates libraries
     
     json_object_object_foreach(root, key, val) {
         (void)key;
@@ -143,158 +614,610 @@ bool CacheManager::loadCache() {
         }
         
         const char* lastUsedStr = json_object_get_string(lastUsedObj);
-        std::string lastUsed = lastUsedStr ? lastUsedStr : "";
+        time_t lastUsed = parseTimestamp(lastUsedStr ? lastUsedStr : "");
         
-        if (!metadata.lpath.empty()) {
-            cacheData.emplace(metadata.lpath, CacheEntry(metadata, lastUsed));
+        if (!metadata.lpath.empty() && !legacy.overlay.count(metadata.lpath)) {
+            legacy.overlay.emplace(metadata.lpath, makeEntry(metadata, lastUsed));
             loaded++;
         }
     }
     
     json_object_put(root);
     
-    LOG_CACHE("Loaded %d entries from cache", loaded);
+    legacy.liveCount = legacy.overlay.size();
+    LOG_CACHE("Loaded %d entries from JSON cache", loaded);
     return true;
 }
 
 bool CacheManager::saveCache() {
-    LOG_CACHE("Saving cache with %d entries", (int)cacheData.size());
+    waitForLoad();
     
-    purgeOldEntries(30);
+    if (cacheFilePath.empty()) return false;
+    TimelineSpan span("cache-save", "file");
     
-    std::string tmpFilePath = cacheFilePath + ".tmp";
-    FILE* f = fopen(tmpFilePath.c_str(), "w");
-    if (!f) {
-        LOG_CACHE("Failed to open tmp cache file for writing");
-        return false;
+    if (journalBytes > JOURNAL_COMPACT_BYTES) {
+        return compact();
     }
     
-    fprintf(f, "{");
-    
-    bool first = true;
-    for (const auto& entry : cacheData) {
-        if (!first) fprintf(f, ",");
-        first = false;
+    // Below the threshold only the appended records need to reach the disk
+    if (journal) {
+        fflush(journal);
+        fsync(fileno(journal));
+    }
+    dirty = false;
+    LOG_CACHE("Journal synced (%ld bytes)", journalBytes);
+    return true;
+}
 
-        const BookMetadata& meta = entry.second.metadata;
+bool CacheManager::compact() {
+    size_t overlayEntries = 0;
+    for (const auto& item : partitions) overlayEntries += item.second.overlay.size();
+    LOG_CACHE("Compacting cache with %d entries (journal %ld bytes, %d overlay entries using %d bytes, arena %d)",
+              (int)totalCount(), journalBytes, (int)overlayEntries, (int)overlayBytes(), (int)arena.bytes());
+    
+    purgeInactiveLibraries();
+    
+    struct Record {
+        const char* lpath;
+        const CacheFileEntry* fileEntry;
+        const CacheEntry* entry;
+    };
+    
+    StringTableWriter strings;
+    std::vector<CacheFileEntry> pool;
+    std::unordered_map<std::string, uint32_t> poolIndex; // Entry minus lastUsed -> pool slot
+    std::vector<CacheFileLibrary> libraries;
+    std::vector<uint32_t> index;
+    
+    for (auto& item : partitions) {
+        const Partition& part = item.second;
         
-        // Escape lpath for JSON key
-        std::string escapedPath = entry.first;
-        size_t pos = 0;
-        while ((pos = escapedPath.find('\\', pos)) != std::string::npos) {
-            escapedPath.replace(pos, 1, "\\\\");
-            pos += 2;
+        // Gather surviving file entries and the overlay, then sort by lpath
+        std::vector<Record> records;
+        records.reserve(part.liveCount);
+        for (uint32_t i = 0; i < part.indexCount; i++) {
+            const CacheFileEntry& in = fileEntry(part, i);
+            const char* lpath = fileStrings + in.lpath;
+            if (part.removed.count(lpath) || part.overlay.count(lpath)) continue;
+            Record record = { lpath, &in, nullptr };
+            records.push_back(record);
         }
-        pos = 0;
-        while ((pos = escapedPath.find('"', pos)) != std::string::npos) {
-            escapedPath.replace(pos, 1, "\\\"");
-            pos += 2;
+        for (const auto& entry : part.overlay) {
+            Record record = { entry.first.c_str(), nullptr, &entry.second };
+            records.push_back(record);
         }
+        if (records.empty()) continue;
         
-        fprintf(f, "\n  \"%s\": {", escapedPath.c_str());
-        fprintf(f, "\n    \"book\": {");
-        fprintf(f, "\n      \"uuid\": \"%s\",", meta.uuid.c_str());
-        fprintf(f, "\n      \"title\": \"%s\",", meta.title.c_str());
-        fprintf(f, "\n      \"authors\": \"%s\",", meta.authors.c_str());
-        fprintf(f, "\n      \"lpath\": \"%s\",", meta.lpath.c_str());
-        fprintf(f, "\n      \"last_modified\": \"%s\",", meta.lastModified.c_str());
-        fprintf(f, "\n      \"_is_read_\": %s,", meta.isRead ? "true" : "false");
+        std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+            return strcmp(a.lpath, b.lpath) < 0;
+        });
         
-        if (!meta.lastReadDate.empty()) {
-            fprintf(f, "\n      \"_last_read_date_\": \"%s\",", meta.lastReadDate.c_str());
-        }
+        CacheFileLibrary library;
+        library.uuid = strings.add(item.first);
+        library.indexOffset = (uint32_t)index.size(); // Made absolute below
+        library.indexCount = (uint32_t)records.size();
+        libraries.push_back(library);
         
-        fprintf(f, "\n      \"_is_favorite_\": %s", meta.isFavorite ? "true" : "false");
-        fprintf(f, "\n    },");
-        fprintf(f, "\n    \"last_used\": \"%s\"", entry.second.lastUsed.c_str());
-        fprintf(f, "\n  }");
+        for (size_t i = 0; i < records.size(); i++) {
+            CacheFileEntry out;
+            out.lpath = strings.add(records[i].lpath);
+            
+            if (records[i].fileEntry) {
+                const CacheFileEntry& in = *records[i].fileEntry;
+                out.uuid = strings.add(fileStrings + in.uuid);
+                out.title = strings.add(fileStrings + in.title);
+                out.authors = strings.add(fileStrings + in.authors);
+                out.lastModified = strings.add(fileStrings + in.lastModified);
+                out.lastReadDate = strings.add(fileStrings + in.lastReadDate);
+                out.lastUsed = in.lastUsed;
+                out.flags = in.flags & CACHE_FLAG_STORED;
+            } else {
+                const CacheEntry& in = *records[i].entry;
+                out.uuid = strings.add(arena.get(in.uuid));
+                out.title = strings.add(arena.get(in.title));
+                out.authors = strings.add(arena.get(in.authors));
+                out.lastModified = strings.add(arena.get(in.lastModified));
+                out.lastReadDate = strings.add(arena.get(in.lastReadDate));
+                out.lastUsed = in.lastUsed;
+                out.flags = in.flags & CACHE_FLAG_STORED;
+            }
+            
+            // Identical strings share offsets, so equal keys mean equal entries
+            uint32_t lastUsed = out.lastUsed;
+            out.lastUsed = 0;
+            std::string key((const char*)&out, sizeof(out));
+            auto found = poolIndex.find(key);
+            if (found == poolIndex.end()) {
+                out.lastUsed = lastUsed;
+                found = poolIndex.emplace(key, (uint32_t)pool.size()).first;
+                pool.push_back(out);
+            } else if (lastUsed > pool[found->second].lastUsed) {
+                pool[found->second].lastUsed = lastUsed;
+            }
+            index.push_back(found->second);
+        }
     }
     
-    fprintf(f, "\n}\n");
+    CacheFileHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.libraryCount = (uint32_t)libraries.size();
+    header.librariesOffset = sizeof(CacheFileHeader);
+    uint32_t indexOffset = header.librariesOffset + (uint32_t)(libraries.size() * sizeof(CacheFileLibrary));
+    header.entryCount = (uint32_t)pool.size();
+    header.entriesOffset = indexOffset + (uint32_t)(index.size() * sizeof(uint32_t));
+    header.stringsOffset = header.entriesOffset + (uint32_t)(pool.size() * sizeof(CacheFileEntry));
+    header.stringsSize = (uint32_t)strings.bytes().size();
     
+    for (size_t i = 0; i < libraries.size(); i++) {
+        libraries[i].indexOffset = indexOffset + libraries[i].indexOffset * (uint32_t)sizeof(uint32_t);
+    }
+    
+    std::string tmpFilePath = cacheFilePath + ".tmp";
+    FILE* f = fopen(tmpFilePath.c_str(), "wb");
+    if (!f) {
+        LOG_CACHE("Failed to open tmp cache file for writing");
+        return false;
+    }
+    
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                   (libraries.empty() || fwrite(libraries.data(), sizeof(CacheFileLibrary), libraries.size(), f) == libraries.size()) &&
+                   (index.empty() || fwrite(index.data(), sizeof(uint32_t), index.size(), f) == index.size()) &&
+                   (pool.empty() || fwrite(pool.data(), sizeof(CacheFileEntry), pool.size(), f) == pool.size()) &&
+                   fwrite(strings.bytes().data(), 1, strings.bytes().size(), f) == strings.bytes().size();
     fflush(f);
     fsync(fileno(f));
     fclose(f);
     
+    if (!written) {
+        LOG_CACHE("Failed to write tmp cache file");
+        unlink(tmpFilePath.c_str());
+        return false;
+    }
+    
+    // The old mapping stays valid after the rename; on failure it keeps
+    // serving together with the overlays
     if (rename(tmpFilePath.c_str(), cacheFilePath.c_str()) != 0) {
         LOG_CACHE("Failed to rename temp file to cache file");
         unlink(tmpFilePath.c_str());
         return false;
     }
     
-    LOG_CACHE("Cache saved successfully (streaming write)");
+    // Presence marks index the old file, so a listing in progress is
+    // carried over by lpath
+    bool wasListed = listed;
+    std::vector<std::string> present;
+    if (wasListed) present = presentLpaths();
+    
+    std::string library = activeLibrary;
+    unmapFile();
+    resetPartitions();
+    bool mapped = mapFile();
+    activeLibrary = library;
+    active = &partition(library);
+    for (size_t i = 0; i < present.size(); i++) markPresent(present[i]);
+    listed = wasListed;
+    if (!mapped) {
+        LOG_CACHE("Failed to map the cache that was just written");
+        return false;
+    }
+    
+    // Everything in the journal is now in the file
+    resetJournal();
+    dirty = false;
+    LOG_CACHE("Cache saved successfully (%d libraries, %d entries sharing %d pool slots, %d bytes of strings)",
+              (int)header.libraryCount, (int)index.size(), (int)header.entryCount, (int)header.stringsSize);
     return true;
 }
 
 std::string CacheManager::getUuidForLpath(const std::string& lpath) const {
-    auto it = cacheData.find(lpath);
-    if (it != cacheData.end()) {
-        return it->second.metadata.uuid;
+    waitForLoad();
+    
+    auto it = active->overlay.find(lpath);
+    if (it != active->overlay.end()) {
+        return arena.get(it->second.uuid);
     }
-    return "";
+    const CacheFileEntry* entry = findInFile(*active, lpath);
+    return entry ? std::string(fileStrings + entry->uuid) : "";
 }
 
 bool CacheManager::getCachedMetadata(const std::string& lpath, BookMetadata& outMetadata) const {
-    auto it = cacheData.find(lpath);
-    if (it != cacheData.end()) {
-        outMetadata = it->second.metadata;
+    waitForLoad();
+    
+    auto it = active->overlay.find(lpath);
+    if (it != active->overlay.end()) {
+        readEntry(lpath, it->second, outMetadata);
+        stats.hits++;
         return true;
     }
+    const CacheFileEntry* entry = findInFile(*active, lpath);
+    if (entry) {
+        readFileEntry(*entry, outMetadata);
+        stats.hits++;
+        return true;
+    }
+    stats.misses++;
     return false;
 }
 
 void CacheManager::updateCache(const BookMetadata& metadata) {
+    waitForLoad();
+    
     if (metadata.lpath.empty()) {
         return;
     }
     
     std::string uuidToStore = metadata.uuid;
-    
-    // Используем find, который в unordered_map работает за O(1)
-    auto it = cacheData.find(metadata.lpath);
-    if (it != cacheData.end()) {
-        if (uuidToStore.empty()) {
-            uuidToStore = it->second.metadata.uuid;
-        }
+    if (uuidToStore.empty()) {
+        uuidToStore = getUuidForLpath(metadata.lpath);
     }
     
-    // Оптимизация: избегаем лишнего копирования при создании записи
     BookMetadata newMeta = metadata;
-    newMeta.uuid = uuidToStore; // перемещение строки, если возможно, но здесь просто присваивание
+    newMeta.uuid = uuidToStore;
+    CacheEntry entry = makeEntry(newMeta, time(NULL));
     
-    std::string timestamp = getCurrentTimestamp();
+    std::string record;
+    putU32(record, JOURNAL_UPDATE);
+    putString(record, activeLibrary);
+    putU32(record, entry.lastUsed);
+    putU32(record, entry.flags);
+    putString(record, newMeta.lpath);
+    putString(record, newMeta.uuid);
+    putString(record, newMeta.title);
+    putString(record, newMeta.authors);
+    putString(record, newMeta.lastModified);
+    putString(record, newMeta.lastReadDate);
+    appendRecord(record);
     
-    // insert_or_assign (C++17) или оператор []
-    cacheData[metadata.lpath] = CacheEntry(newMeta, timestamp);
+    applyUpdate(*active, newMeta.lpath, entry);
 }
 
 void CacheManager::removeFromCache(const std::string& lpath) {
-    cacheData.erase(lpath);
+    waitForLoad();
+    
+    if (contains(*active, lpath)) {
+        std::string record;
+        putU32(record, JOURNAL_REMOVE);
+        putString(record, activeLibrary);
+        putString(record, lpath);
+        appendRecord(record);
+        
+        applyRemove(*active, lpath);
+    }
     LOG_CACHE("Removed from cache: %s", lpath.c_str());
 }
 
-void CacheManager::purgeOldEntries(int days) {
-    time_t now = time(NULL);
-    time_t threshold = now - (days * 24 * 60 * 60);
+void CacheManager::applyUpdate(Partition& part, const std::string& lpath, const CacheEntry& entry) {
+    bool existed = contains(part, lpath);
     
-    auto it = cacheData.begin();
-    while (it != cacheData.end()) {
-        // Оптимизация: быстрая проверка перед парсингом, если строка пустая
-        if (it->second.lastUsed.empty()) {
-             it = cacheData.erase(it);
-             continue;
+    // The mapped copy, if any, is superseded by the overlay until compaction
+    part.overlay[lpath] = entry;
+    part.removed.erase(lpath);
+    if (!existed) part.liveCount++;
+}
+
+void CacheManager::applyRemove(Partition& part, const std::string& lpath) {
+    if (!contains(part, lpath)) return;
+    
+    part.overlay.erase(lpath);
+    if (findInFile(part, lpath)) part.removed.insert(lpath);
+    part.liveCount--;
+}
+
+void CacheManager::applyClear(Partition& part) {
+    part.overlay.clear();
+    part.removed.clear();
+    for (uint32_t i = 0; i < part.indexCount; i++) {
+        part.removed.insert(fileStrings + fileEntry(part, i).lpath);
+    }
+    part.liveCount = 0;
+}
+
+void CacheManager::applyAdopt(const std::string& libraryUuid) {
+    Partition& from = partition("");
+    Partition& to = partition(libraryUuid);
+    
+    // Checked again here so replaying the record after a compaction that
+    // already moved the entries changes nothing
+    if (libraryUuid.empty() || from.liveCount == 0 || to.liveCount > 0) return;
+    
+    to = std::move(from);
+    from = Partition();
+}
+
+void CacheManager::purgeInactiveLibraries() {
+    time_t threshold = time(NULL) - (time_t)INACTIVE_MAX_AGE_DAYS * 24 * 60 * 60;
+    
+    for (auto& item : partitions) {
+        Partition& part = item.second;
+        if (&part == active) continue;
+        
+        auto it = part.overlay.begin();
+        while (it != part.overlay.end()) {
+            if ((time_t)it->second.lastUsed < threshold) {
+                if (findInFile(part, it->first)) part.removed.insert(it->first);
+                part.liveCount--;
+                it = part.overlay.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        
+        for (uint32_t i = 0; i < part.indexCount; i++) {
+            const CacheFileEntry& entry = fileEntry(part, i);
+            if ((time_t)entry.lastUsed >= threshold) continue;
+            
+            const char* lpath = fileStrings + entry.lpath;
+            if (part.overlay.count(lpath) || !part.removed.insert(lpath).second) continue;
+            part.liveCount--;
         }
+    }
+}
 
-        time_t lastUsed = parseTimestamp(it->second.lastUsed);
-        if (lastUsed > 0 && lastUsed < threshold) {
-            it = cacheData.erase(it);
-        } else {
-            ++it;
+void CacheManager::notePresent(const std::string& lpath) {
+    waitForLoad();
+    
+    listed = true;
+    markPresent(lpath);
+}
+
+void CacheManager::markPresent(const std::string& lpath) {
+    auto it = active->overlay.find(lpath);
+    if (it != active->overlay.end()) {
+        it->second.flags |= CACHE_FLAG_PRESENT;
+        return;
+    }
+    
+    uint32_t position;
+    if (findPosition(*active, lpath, position)) {
+        if (active->present.size() != active->indexCount) {
+            active->present.assign(active->indexCount, false);
         }
+        active->present[position] = true;
     }
 }
 
+std::vector<std::string> CacheManager::presentLpaths() const {
+    std::vector<std::string> lpaths;
+    for (const auto& item : active->overlay) {
+        if (item.second.flags & CACHE_FLAG_PRESENT) lpaths.push_back(item.first);
+    }
+    for (uint32_t i = 0; i < active->present.size(); i++) {
+        if (active->present[i]) lpaths.push_back(fileStrings + fileEntry(*active, i).lpath);
+    }
+    return lpaths;
+}
+
+int CacheManager::reconcile(const std::function<bool(const std::string&)>& fileExists) {
+    waitForLoad();
+    
+    if (!listed) return 0;
+    listed = false;
+    
+    long long start = monotonicMs();
+    time_t threshold = time(NULL) - (time_t)UNLISTED_MAX_AGE_DAYS * 24 * 60 * 60;
+    std::vector<std::string> victims;
+    int missing = 0;
+    int aged = 0;
+    
+    auto check = [&](const std::string& lpath, time_t lastUsed) {
+        if (!fileExists(lpath)) {
+            victims.push_back(lpath);
+            missing++;
+        } else if (lastUsed < threshold) {
+            victims.push_back(lpath);
+            aged++;
+        }
+    };
+    
+    for (auto& item : active->overlay) {
+        if (!(item.second.flags & CACHE_FLAG_PRESENT)) {
+            check(item.first, item.second.lastUsed);
+        }
+        item.second.flags &= ~CACHE_FLAG_PRESENT;
+    }
+    
+    bool anyPresent = !active->present.empty();
+    for (uint32_t i = 0; i < active->indexCount; i++) {
+        if (anyPresent && active->present[i]) continue;
+        
+        const CacheFileEntry& entry = fileEntry(*active, i);
+        std::string lpath = fileStrings + entry.lpath;
+        if (active->overlay.count(lpath) || active->removed.count(lpath)) continue;
+        check(lpath, entry.lastUsed);
+    }
+    active->present.clear();
+    
+    for (size_t i = 0; i < victims.size(); i++) {
+        std::string record;
+        putU32(record, JOURNAL_REMOVE);
+        putString(record, activeLibrary);
+        putString(record, victims[i]);
+        appendRecord(record);
+        
+        applyRemove(*active, victims[i]);
+    }
+    
+    stats.evictedMissing += missing;
+    stats.evictedAged += aged;
+    LOG_CACHE("Reconciled with device catalog in %lld ms: %d entries kept, %d dropped (%d files gone, %d unlisted for %d+ days)",
+              monotonicMs() - start, (int)active->liveCount, (int)victims.size(),
+              missing, aged, UNLISTED_MAX_AGE_DAYS);
+    return (int)victims.size();
+}
+
+void CacheManager::resetSessionStats() {
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictedMissing = 0;
+    stats.evictedAged = 0;
+}
+
+void CacheManager::logSessionStats() const {
+    int lookups = stats.hits + stats.misses;
+    LOG_CACHE("Session: %d lookups, %d hits, %d misses (%d%% hit rate), evicted %d missing and %d aged entries",
+              lookups, stats.hits, stats.misses, lookups ? stats.hits * 100 / lookups : 0,
+              stats.evictedMissing, stats.evictedAged);
+}
+
 void CacheManager::clearCache() {
-    cacheData.clear();
+    waitForLoad();
+    
+    std::string record;
+    putU32(record, JOURNAL_CLEAR);
+    putString(record, activeLibrary);
+    appendRecord(record);
+    
+    applyClear(*active);
     LOG_CACHE("Cache cleared");
 }
+
+// --- Journal ---
+
+bool CacheManager::openJournal() {
+    if (journal) return true;
+    if (journalFilePath.empty()) return false;
+    
+    journal = fopen(journalFilePath.c_str(), "ab");
+    if (!journal) {
+        LOG_CACHE("Failed to open cache journal");
+        return false;
+    }
+    
+    fseek(journal, 0, SEEK_END);
+    journalBytes = ftell(journal);
+    if (journalBytes == 0) {
+        fwrite(JOURNAL_MAGIC, 1, sizeof(JOURNAL_MAGIC), journal);
+        fwrite(&JOURNAL_VERSION, sizeof(JOURNAL_VERSION), 1, journal);
+        journalBytes = JOURNAL_HEADER_BYTES;
+    }
+    return true;
+}
+
+void CacheManager::closeJournal() {
+    if (journal) {
+        fclose(journal);
+        journal = nullptr;
+    }
+}
+
+bool CacheManager::resetJournal() {
+    closeJournal();
+    
+    FILE* f = fopen(journalFilePath.c_str(), "wb");
+    if (!f) {
+        LOG_CACHE("Failed to reset cache journal");
+        return false;
+    }
+    fwrite(JOURNAL_MAGIC, 1, sizeof(JOURNAL_MAGIC), f);
+    fwrite(&JOURNAL_VERSION, sizeof(JOURNAL_VERSION), 1, f);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    
+    journalBytes = JOURNAL_HEADER_BYTES;
+    return true;
+}
+
+void CacheManager::appendRecord(const std::string& payload) {
+    if (!openJournal()) return;
+    
+    uint32_t header[2] = { (uint32_t)payload.size(), fnv1a(payload.data(), payload.size()) };
+    fwrite(header, sizeof(header), 1, journal);
+    fwrite(payload.data(), 1, payload.size(), journal);
+    // Flushed to the kernel now; fsync is left to saveCache()
+    fflush(journal);
+    
+    journalBytes += sizeof(header) + payload.size();
+    dirty = true;
+}
+
+int CacheManager::replayJournal() {
+    FILE* f = fopen(journalFilePath.c_str(), "rb");
+    if (!f) return 0;
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    std::vector<char> data(size > 0 ? size : 0);
+    size_t read = size > 0 ? fread(data.data(), 1, size, f) : 0;
+    fclose(f);
+    
+    uint32_t version = 0;
+    if (read == data.size() && size >= JOURNAL_HEADER_BYTES) {
+        memcpy(&version, data.data() + sizeof(JOURNAL_MAGIC), sizeof(version));
+    }
+    if (version < 1 || version > JOURNAL_VERSION ||
+        memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        LOG_CACHE("Cache journal unreadable, discarding");
+        resetJournal();
+        return 0;
+    }
+    
+    int records = 0;
+    long offset = JOURNAL_HEADER_BYTES;
+    
+    while (size - offset >= 8) {
+        uint32_t header[2];
+        memcpy(header, data.data() + offset, sizeof(header));
+        if ((uint32_t)(size - offset - 8) < header[0]) break;
+        
+        const char* payload = data.data() + offset + 8;
+        if (fnv1a(payload, header[0]) != header[1]) break;
+        
+        JournalReader in(payload, header[0]);
+        uint32_t type = in.u32();
+        std::string library = version >= 2 ? in.str() : "";
+        Partition& part = partition(library);
+        
+        if (type == JOURNAL_UPDATE) {
+            BookMetadata meta;
+            time_t lastUsed = in.u32();
+            uint32_t flags = in.u32();
+            meta.lpath = in.str();
+            meta.uuid = in.str();
+            meta.title = in.str();
+            meta.authors = in.str();
+            meta.lastModified = in.str();
+            meta.lastReadDate = in.str();
+            meta.isRead = (flags & CACHE_FLAG_READ) != 0;
+            meta.isFavorite = (flags & CACHE_FLAG_FAVORITE) != 0;
+            if (!in.good() || meta.lpath.empty()) break;
+            applyUpdate(part, meta.lpath, makeEntry(meta, lastUsed));
+        } else if (type == JOURNAL_REMOVE) {
+            std::string lpath = in.str();
+            if (!in.good()) break;
+            applyRemove(part, lpath);
+        } else if (type == JOURNAL_CLEAR) {
+            if (!in.good()) break;
+            applyClear(part);
+        } else if (type == JOURNAL_ADOPT) {
+            if (!in.good()) break;
+            applyAdopt(library);
+        } else {
+            break;
+        }
+        
+        records++;
+        offset += 8 + header[0];
+    }
+    
+    // Records without a library cannot share a file with the new format
+    if (version < JOURNAL_VERSION) {
+        if (records == 0 || !compact()) resetJournal();
+        return records;
+    }
+    
+    // Drop a torn tail so new records are not appended after garbage
+    if (offset < size) {
+        LOG_CACHE("Cache journal: dropping %ld damaged bytes at offset %ld", size - offset, offset);
+        if (truncate(journalFilePath.c_str(), offset) != 0) {
+            resetJournal();
+            return records;
+        }
+    }
+    
+    journalBytes = offset;
+    return records;
+}
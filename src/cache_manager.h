@@ -4,18 +4,75 @@
 #include "book_manager.h"
 #include <string>
 #include <unordered_map> // Оптимизация: HashMap вместо дерева
+#include <unordered_set>
+#include <map>
 #include <vector>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 
-// Cache entry structure matching Calibre's expectations
+// The fields Calibre needs back for one cached book. Strings are offsets
+// into the owning CacheManager's StringArena (0 is the empty string); the
+// lpath is the key the entry is stored under.
 struct CacheEntry {
-    BookMetadata metadata;
-    std::string lastUsed; // ISO 8601 format
+    uint32_t uuid;
+    uint32_t title;
+    uint32_t authors;
+    uint32_t lastModified;
+    uint32_t lastReadDate;
+    uint32_t lastUsed; // Unix time
+    uint32_t flags;
     
-    CacheEntry() {}
-    CacheEntry(const BookMetadata& meta, const std::string& used) 
-        : metadata(meta), lastUsed(used) {}
+    CacheEntry()
+        : uuid(0), title(0), authors(0), lastModified(0), lastReadDate(0),
+          lastUsed(0), flags(0) {}
 };
 
+// Append-only storage for CacheEntry strings. Offsets stay valid until
+// clear(); space of overwritten entries is reclaimed only then.
+class StringArena {
+public:
+    StringArena() : data(1, '\0') {}
+    
+    uint32_t add(const std::string& str);
+    const char* get(uint32_t offset) const { return &data[offset]; }
+    
+    size_t bytes() const { return data.size(); }
+    void clear();
+    
+private:
+    std::vector<char> data;
+};
+
+struct CacheFileHeader;
+struct CacheFileEntry;
+struct CacheFileLibrary;
+
+// The cache lives in calibre_cache_<uuid>.bin, a versioned binary file that
+// is memory-mapped and queried in place:
+//
+//   header | libraries | per-library index | entry pool | string table
+//
+// Each Calibre library has its own partition, selected by the library UUID
+// from SET_LIBRARY_INFO. A partition is a run of pool indices sorted by
+// lpath; entries that are identical in several libraries are stored once
+// in the pool and shared. Entries cached before a library was known (older
+// files, the JSON cache, a session without SET_LIBRARY_INFO) sit in an
+// unassigned partition that the first library selected adopts.
+//
+// Lookups binary-search the active partition. Changes are appended to
+// calibre_cache_<uuid>.jnl as they happen and kept in a per-partition
+// overlay map plus a set of removed lpaths; loading replays the journal over
+// the file. Only when the journal outgrows JOURNAL_COMPACT_BYTES does
+// saveCache() merge everything into a new file. An old JSON cache is
+// migrated on first load.
+//
+// Loading can run on a background thread (initializeAsync). Every other
+// public call waits for a load in progress, so callers never see a
+// half-loaded cache.
 class CacheManager {
 public:
     CacheManager();
@@ -24,8 +81,23 @@ public:
     // Initialize cache for device UUID
     bool initialize(const std::string& deviceUuid);
     
+    // Starts loading on a background thread. Does nothing if the cache for
+    // this UUID is already loaded or loading.
+    void initializeAsync(const std::string& deviceUuid);
+    
+    bool isLoading() const { return loading; }
+    
+    // Blocks until a background load has finished
+    void waitForLoad() const;
+    
+    // Makes the partition of a Calibre library the active one
+    void selectLibrary(const std::string& libraryUuid);
+    
     // Cache operations
     bool loadCache();
+    
+    // Makes the journal durable, and compacts it into the cache file once
+    // it has grown past the threshold
     bool saveCache();
     
     // Get cached UUID for a specific file path
@@ -42,25 +114,142 @@ public:
     // Remove from cache
     void removeFromCache(const std::string& lpath);
     
-    // Clear old entries (called during save)
-    void purgeOldEntries(int days = 30);
+    // Presence reconciliation. The protocol reports every lpath it lists
+    // to Calibre; reconcile() then drops active-library entries that were
+    // not listed and whose file is gone. Unlisted entries whose file still
+    // exists (e.g. on a storage Calibre did not ask about) are kept for
+    // UNLISTED_MAX_AGE_DAYS. Does nothing unless a listing was reported
+    // since the last call. Returns the number of entries dropped.
+    void notePresent(const std::string& lpath);
+    int reconcile(const std::function<bool(const std::string&)>& fileExists);
     
-    // Get cache statistics
-    int getCacheSize() const { return cacheData.size(); }
+    // Lookup and eviction counters for the current session
+    void resetSessionStats();
+    void logSessionStats() const;
     
-    // Clear all cache
+    // Entries in the active library
+    int getCacheSize() const { waitForLoad(); return (int)active->liveCount; }
+    
+    // True if journal records were written since the last successful save
+    bool isDirty() const { waitForLoad(); return dirty; }
+    
+    long getJournalBytes() const { waitForLoad(); return journalBytes; }
+    
+    // Clear the active library's entries
     void clearCache();
     
 private:
+    static const long JOURNAL_COMPACT_BYTES = 256 * 1024;
+    static const int UNLISTED_MAX_AGE_DAYS = 30;
+    
+    // Entries of libraries other than the active one, which are never
+    // reconciled, are dropped at compaction once they are this old
+    static const int INACTIVE_MAX_AGE_DAYS = 365;
+    
     std::string deviceUuid;
-    std::string cacheFilePath;
+    std::string cacheFilePath;      // Binary cache
+    std::string journalFilePath;    // Changes since the cache file was written
+    std::string legacyFilePath;     // JSON cache from older versions
+    
+    // Mapped file (read-only)
+    void* mapBase;
+    size_t mapSize;
+    const CacheFileEntry* fileEntries; // Shared pool
+    uint32_t fileEntryCount;
+    const char* fileStrings;
+    
+    struct Partition {
+        // Pool indices sorted by lpath; nullptr means the whole pool in
+        // order (version 1 files)
+        const uint32_t* index;
+        uint32_t indexCount;
+        
+        // Changes since the last save. Key: lpath (relative to root);
+        // entry strings live in `arena`
+        std::unordered_map<std::string, CacheEntry> overlay;
+        std::unordered_set<std::string> removed; // Lpaths deleted from the file
+        size_t liveCount;
+        
+        // File positions listed to Calibre this session (overlay entries
+        // carry a flag instead)
+        std::vector<bool> present;
+        
+        Partition() : index(nullptr), indexCount(0), liveCount(0) {}
+    };
+    
+    // Key: library UUID, "" for the unassigned partition
+    std::map<std::string, Partition> partitions;
+    std::string activeLibrary;
+    Partition* active;
+    StringArena arena;
+    bool listed; // notePresent() called since the last reconcile()
+    
+    struct SessionStats {
+        int hits;
+        int misses;
+        int evictedMissing;
+        int evictedAged;
+    };
+    mutable SessionStats stats;
+    bool dirty;
+    
+    FILE* journal;
+    long journalBytes;
+    
+    // Background load
+    std::thread loader;
+    mutable std::mutex loadMutex;
+    mutable std::condition_variable loadDone;
+    std::atomic<bool> loading;
+    std::string requestedUuid; // Last UUID passed to initialize/initializeAsync
+    
+    bool load(const std::string& deviceUuid);
+    void finishLoader();
+    
+    bool mapFile();
+    void unmapFile();
+    bool loadLegacyJson();
+    
+    // Rewrites the cache file from the mapped entries and the overlay
+    bool compact();
+    
+    // Journal records are idempotent, so replaying a journal that was
+    // already compacted into the file is harmless
+    bool openJournal();
+    void closeJournal();
+    bool resetJournal();
+    void appendRecord(const std::string& payload);
+    int replayJournal();
+    
+    // In-memory effect of a change, shared by the public API and replay
+    void applyUpdate(Partition& part, const std::string& lpath, const CacheEntry& entry);
+    void applyRemove(Partition& part, const std::string& lpath);
+    void applyClear(Partition& part);
+    void applyAdopt(const std::string& libraryUuid);
+    
+    Partition& partition(const std::string& libraryUuid);
+    void resetPartitions();
+    size_t totalCount() const;
+    void markPresent(const std::string& lpath);
+    std::vector<std::string> presentLpaths() const;
+    void purgeInactiveLibraries();
+    
+    // i-th mapped entry of a partition, in lpath order
+    const CacheFileEntry& fileEntry(const Partition& part, uint32_t i) const;
+    
+    // Position of an lpath in a partition's file index, removed or not
+    bool findPosition(const Partition& part, const std::string& lpath, uint32_t& position) const;
+    
+    // Mapped entry for an lpath that has not been removed, or nullptr
+    const CacheFileEntry* findInFile(const Partition& part, const std::string& lpath) const;
+    bool contains(const Partition& part, const std::string& lpath) const;
     
-    // Оптимизация: unordered_map для доступа O(1)
-    // Key: lpath (file path relative to root), Value: CacheEntry
-    std::unordered_map<std::string, CacheEntry> cacheData; 
+    CacheEntry makeEntry(const BookMetadata& metadata, time_t lastUsed);
+    void readEntry(const std::string& lpath, const CacheEntry& entry, BookMetadata& out) const;
+    void readFileEntry(const CacheFileEntry& entry, BookMetadata& out) const;
     
-    // Helper to get current ISO timestamp
-    std::string getCurrentTimestamp() const;
+    // Approximate heap held by the overlays and the arena
+    size_t overlayBytes() const;
     
     // Helper to parse ISO timestamp
     time_t parseTimestamp(const std::string& isoTime) const;
@@ -1,4 +1,8 @@
 #include "calibre_protocol.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timeline.h"
+#include "alloc_tracker.h"
 #include <sys/stat.h>
 #include <errno.h>
 #include <vector>
@@ -12,33 +16,54 @@
 #include <iomanip>
 #include <ctime>
 #include <memory>
+#include <chrono>
 
 // Constants synchronized with driver.py
 static const int BASE_PACKET_LEN = 4096;
-static const int COVER_HEIGHT = 240;
+static const int COVER_HEIGHT = CoverQueue::COVER_HEIGHT;
 static const int DEFAULT_PATH_LENGTH = 37;
 static const int PROTOCOL_VERSION = 1;
 
-// Helper for logging with levels
-enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_ERROR };
+// Maintenance tasks: quiet time required before running, and the maximum
+// time a change may wait before it is forced through at an opcode boundary
+static const int CHECKPOINT_IDLE_MS = 1000;
+static const int CHECKPOINT_MAX_STALE_MS = 60 * 1000;
+static const int CACHE_SAVE_IDLE_MS = 3000;
+static const int CACHE_SAVE_MAX_STALE_MS = 120 * 1000;
+static const int LOG_FLUSH_IDLE_MS = 200;
+static const int LOG_FLUSH_MAX_STALE_MS = 2000;
 
-static void logProto(LogLevel level, const char* fmt, ...) {
-    if (level == LOG_DEBUG) return; 
+// Group commit for received books: commit every N books or T seconds
+static const int INGEST_GROUP_BOOKS = 25;
+static const int INGEST_GROUP_SECONDS = 5;
+static const int INGEST_COMMIT_IDLE_MS = 1000;
 
-    FILE* f = fopen("/mnt/ext1/system/calibre-connect.log", "a");
-    if (f) {
-        const char* prefix[] = {"[DEBUG]", "[INFO]", "[ERROR]"};
-        fprintf(f, "%s ", prefix[level]);
-        
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(f, fmt, args);
-        va_end(args);
-        fprintf(f, "\n");
-        // fflush(f); // Уберите fflush для ускорения, если не нужен реал-тайм лог при крешах
-        fclose(f);
-    }
-}
+// Queued covers render once the connection has been quiet this long
+static const int COVER_IDLE_MS = 2000;
+static const int COVER_MAX_STALE_MS = 10 * 60 * 1000;
+
+// Library notifications collected during a sync are sent once the
+// connection has been quiet this long, or at the latest after the bound
+static const int LIBRARY_NOTIFY_IDLE_MS = 1500;
+static const int LIBRARY_NOTIFY_MAX_STALE_MS = 30 * 1000;
+
+// How often a quiet connection looks for flush requests from the cover worker
+static const int NOTIFY_POLL_MS = 1000;
+
+// Session metrics are rewritten in idle gaps so they can be read while
+// Calibre is still connected
+static const char* METRICS_PATH = "/mnt/ext1/system/calibre-connect-metrics.json";
+static const int METRICS_IDLE_MS = 5000;
+static const int METRICS_MAX_STALE_MS = 5 * 60 * 1000;
+
+// Written at disconnect when the timeline is enabled
+static const char* TIMELINE_PATH = "/mnt/ext1/system/calibre-connect-timeline.json";
+
+// The library is scanned for books without a cached cover once per
+// session, after the sync, when the connection has been quiet this long
+static const int COVER_BACKFILL_IDLE_MS = 5000;
+
+#define logProto(level, ...) LOG_AT(level, NULL, __VA_ARGS__)
 
 // RAII wrapper for FILE*
 class FileHandle {
@@ -51,17 +76,6 @@ public:
     operator bool() const { return file != nullptr; }
 };
 
-// RAII wrapper for sqlite3_stmt
-class StmtHandle {
-    sqlite3_stmt* stmt;
-public:
-    explicit StmtHandle(sqlite3_stmt* s = nullptr) : stmt(s) {}
-    ~StmtHandle() { if (stmt) sqlite3_finalize(stmt); }
-    sqlite3_stmt* get() const { return stmt; }
-    sqlite3_stmt** ptr() { return &stmt; }
-    operator bool() const { return stmt != nullptr; }
-};
-
 static int recursiveMkdir(const std::string& path) {
     std::string current_path;
     std::string path_copy = path;
@@ -114,15 +128,17 @@ static std::string safeGetJsonString(json_object* val) {
 }
 
 CalibreProtocol::CalibreProtocol(NetworkManager* net, BookManager* bookMgr,
-                                 CacheManager* cacheMgr,
+                                 CacheManager* cacheMgr, CoverQueue* covers,
+                                 LibraryNotifier* notifier,
                                  const std::string& readCol, 
                                  const std::string& readDateCol, 
                                  const std::string& favCol) 
-    : network(net), bookManager(bookMgr), cacheManager(cacheMgr),
-      connected(false),
+    : network(net), bookManager(bookMgr), cacheManager(cacheMgr), coverQueue(covers),
+      libraryNotifier(notifier),
+      connected(false), sessionClosed(false), coverBackfillQueued(false),
       readColumn(readCol), readDateColumn(readDateCol), favoriteColumn(favCol),
       currentBookLength(0), currentBookReceived(0), currentBookFile(nullptr),
-      booksReceivedInSession(0), lastBatchCount(0) {
+      booksReceivedInSession(0), lastBatchCount(0), writer(bookMgr) {
     
     const char* model = GetDeviceModel();
     if (model && strlen(model) > 0) {
@@ -133,6 +149,35 @@ CalibreProtocol::CalibreProtocol(NetworkManager* net, BookManager* bookMgr,
     
     appVersion = "1.0.1";
     
+    writer.start();
+    
+    checkpointTask = maintenance.addTask("wal-checkpoint", CHECKPOINT_IDLE_MS, CHECKPOINT_MAX_STALE_MS,
+        [this]() { writer.checkpoint(); });
+    cacheSaveTask = maintenance.addTask("cache-save", CACHE_SAVE_IDLE_MS, CACHE_SAVE_MAX_STALE_MS,
+        [this]() { if (cacheManager && cacheManager->isDirty()) cacheManager->saveCache(); });
+    logFlushTask = maintenance.addTask("log-flush", LOG_FLUSH_IDLE_MS, LOG_FLUSH_MAX_STALE_MS,
+        []() { flushLog(); });
+    ingestCommitTask = maintenance.addTask("ingest-commit", INGEST_COMMIT_IDLE_MS, INGEST_GROUP_SECONDS * 1000,
+        [this]() { writer.flushIngestGroup(); });
+    coverTask = maintenance.addTask("covers", COVER_IDLE_MS, COVER_MAX_STALE_MS,
+        [this]() { if (coverQueue) coverQueue->resume(); });
+    coverBackfillTask = maintenance.addTask("cover-backfill", COVER_BACKFILL_IDLE_MS, COVER_MAX_STALE_MS,
+        [this]() { queueCoverBackfill(); });
+    libraryNotifyTask = maintenance.addTask("library-notify", LIBRARY_NOTIFY_IDLE_MS, LIBRARY_NOTIFY_MAX_STALE_MS,
+        [this]() {
+            // Not before the writes they announce have committed: the flush
+            // is queued behind them and reapWrites sends once it is done
+            if (libraryNotifier && !pendingNotifyCommit.valid()) {
+                pendingNotifyCommit = writer.flushIngestGroup();
+            }
+        });
+    metricsTask = maintenance.addTask("metrics", METRICS_IDLE_MS, METRICS_MAX_STALE_MS,
+        []() { MetricsRegistry::instance().writeJson(METRICS_PATH); });
+    
+    // Until disconnect, notifications are sent only from the library-notify
+    // task, after the writes they announce have committed
+    if (libraryNotifier) libraryNotifier->setGated(true);
+    
     logProto(LOG_INFO, "Device name: %s", deviceName.c_str());
 }
 
@@ -224,6 +269,12 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
     CalibreOpcode opcode;
     std::string jsonData;
     
+    MetricsRegistry::instance().reset();
+    AllocTracker::reset();
+    Timeline::instance().begin();
+    Timeline::instance().setThreadName("connection");
+    TimelineSpan span("handshake", "protocol");
+    
     if (!network->receiveJSON(opcode, jsonData)) {
         errorMessage = "Failed to receive initialization request";
         return false;
@@ -234,6 +285,12 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
         return false;
     }
     
+    // Covers left over from the last run wait for the first quiet gap
+    if (coverQueue) {
+        coverQueue->pause();
+        if (coverQueue->hasPending()) maintenance.markDirty(coverTask);
+    }
+    
     json_object* request = parseJSON(jsonData);
     if (!request) {
         errorMessage = "Failed to parse initialization request";
@@ -306,8 +363,10 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
     
     deviceUuid = uuid;
     
+    // Usually already loading since app start; GET_BOOK_COUNT waits for it
     if (cacheManager) {
-        cacheManager->initialize(deviceUuid);
+        cacheManager->initializeAsync(deviceUuid);
+        cacheManager->resetSessionStats();
     }
     
     json_object_object_add(deviceData, "device_store_uuid", 
@@ -337,6 +396,42 @@ bool CalibreProtocol::performHandshake(const std::string& password) {
     return true;
 }
 
+bool CalibreProtocol::waitForRequest() {
+    // Idle tasks do not extend the wait: a peer gone without a FIN is
+    // given up on after the same timeout a blocking receive would have
+    long long deadline = MetricsRegistry::nowMicros() + NetworkManager::RECEIVE_TIMEOUT_MS * 1000LL;
+    
+    while (true) {
+        long long remainingMs = (deadline - MetricsRegistry::nowMicros()) / 1000;
+        if (remainingMs <= 0) return false;
+        
+        takeNotifyRequest();
+        
+        int delayMs = maintenance.nextIdleDelayMs();
+        bool idleDue = delayMs >= 0 && delayMs < remainingMs;
+        int waitMs = idleDue ? delayMs : (int)remainingMs;
+        // Polled, so a requested notification flush is not held back
+        // until the next request
+        if (libraryNotifier && waitMs > NOTIFY_POLL_MS) {
+            waitMs = NOTIFY_POLL_MS;
+            idleDue = false;
+        }
+        {
+            PhaseTimer timer(MetricsRegistry::PHASE_WAIT);
+            TimelineSpan span("wait-request", "wait");
+            // Data (or an error for receiveJSON to report) ends the wait
+            if (network->waitReadable(waitMs) != 0) return true;
+        }
+        
+        PhaseTimer timer(MetricsRegistry::PHASE_MAINTENANCE);
+        reapWrites(false);
+        if (!idleDue) continue;
+        
+        TimelineSpan span("idle-tasks", "maintenance");
+        maintenance.runIdle();
+    }
+}
+
 void CalibreProtocol::handleMessages(std::function<void(const std::string&)> statusCallback) {
     int lastBooklistCount = 0;
     
@@ -344,7 +439,20 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
         CalibreOpcode opcode;
         std::string jsonData;
         
-        if (!network->receiveJSON(opcode, jsonData)) {
+        MetricsRegistry& metrics = MetricsRegistry::instance();
+        if (!waitForRequest()) {
+            logProto(LOG_ERROR, "No data from Calibre for %d s", NetworkManager::RECEIVE_TIMEOUT_MS / 1000);
+            errorMessage = "Connection lost";
+            connected = false;
+            break;
+        }
+        
+        long long phaseStart = MetricsRegistry::nowMicros();
+        AllocTracker::setPhase(MetricsRegistry::PHASE_RECEIVE);
+        bool received = network->receiveJSON(opcode, jsonData);
+        metrics.addPhaseTime(MetricsRegistry::PHASE_RECEIVE, MetricsRegistry::nowMicros() - phaseStart);
+        
+        if (!received) {
             if (network->isConnected()) {
                 logProto(LOG_ERROR, "Failed to receive message");
                 errorMessage = "Connection lost";
@@ -355,7 +463,10 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
             break;
         }
         
+        phaseStart = MetricsRegistry::nowMicros();
+        AllocTracker::setPhase(MetricsRegistry::PHASE_PARSE);
         json_object* args = parseJSON(jsonData);
+        metrics.addPhaseTime(MetricsRegistry::PHASE_PARSE, MetricsRegistry::nowMicros() - phaseStart);
         if (!args) {
             logProto(LOG_ERROR, "Failed to parse JSON for opcode %d", (int)opcode);
             sendErrorResponse("Failed to parse request");
@@ -365,6 +476,19 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
         bool shouldDisconnect = false;
         bool handlerSuccess = true;
         
+        // A bare NOOP is Calibre's keepalive and does not end an idle gap
+        bool keepalive = (opcode == NOOP && json_object_object_length(args) == 0);
+        maintenance.noteRequest(keepalive);
+        if (!keepalive && coverQueue) {
+            coverQueue->pause();
+            if (coverQueue->hasPending()) maintenance.markDirty(coverTask);
+        }
+        
+        phaseStart = MetricsRegistry::nowMicros();
+        metrics.beginRequest(opcode, jsonData.size());
+        AllocTracker::setPhase(MetricsRegistry::PHASE_HANDLE);
+        AllocTracker::beginRequest(opcode);
+        
         switch (opcode) {
             case SET_CALIBRE_DEVICE_INFO:
                 handlerSuccess = handleSetCalibreInfo(args);
@@ -392,12 +516,17 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
                 break;
                 
             case GET_BOOK_COUNT:
+                // Books Calibre sends from here until SEND_BOOKLISTS share
+                // group-committed transactions
+                writer.beginIngestBatch(INGEST_GROUP_BOOKS, INGEST_GROUP_SECONDS);
                 handlerSuccess = handleGetBookCount(args);
                 statusCallback("Sent book count");
                 lastBooklistCount = booksReceivedInSession;
                 break;
                 
             case SEND_BOOKLISTS: {
+                writer.endIngestBatch();
+                reconcileCache();
                 handlerSuccess = handleSendBooklists(args);
                 statusCallback("Processing booklists");
                 
@@ -412,6 +541,8 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
             }
                 
             case SEND_BOOK:
+                // Later uploads in the same session open a new batch
+                writer.beginIngestBatch(INGEST_GROUP_BOOKS, INGEST_GROUP_SECONDS);
                 handlerSuccess = handleSendBook(args);
                 if (handlerSuccess) {
                     statusCallback("BOOK_RECEIVED");
@@ -458,6 +589,45 @@ void CalibreProtocol::handleMessages(std::function<void(const std::string&)> sta
         
         freeJSON(args);
         
+        switch (opcode) {
+            case SEND_BOOK:
+            case SEND_BOOK_METADATA:
+            case DELETE_BOOK:
+                maintenance.markDirty(checkpointTask);
+                maintenance.markDirty(cacheSaveTask);
+                // A no-op on the writer when no ingest batch is open
+                maintenance.markDirty(ingestCommitTask);
+                break;
+            case SEND_BOOKLISTS:
+                maintenance.markDirty(checkpointTask);
+                maintenance.markDirty(cacheSaveTask);
+                // Calibre sends booklists after every batch; one pass over
+                // the device per session is enough
+                if (!coverBackfillQueued) {
+                    coverBackfillQueued = true;
+                    maintenance.markDirty(coverBackfillTask);
+                }
+                break;
+            default:
+                break;
+        }
+        long long handled = MetricsRegistry::nowMicros() - phaseStart;
+        metrics.endRequest(handled);
+        metrics.addPhaseTime(MetricsRegistry::PHASE_HANDLE, handled);
+        Timeline::instance().addSpan(MetricsRegistry::opcodeName(opcode), "opcode", phaseStart, handled);
+        AllocTracker::endRequest();
+        AllocTracker::setPhase(-1);
+        
+        maintenance.markDirty(logFlushTask);
+        if (!keepalive) maintenance.markDirty(metricsTask);
+        takeNotifyRequest();
+        {
+            PhaseTimer timer(MetricsRegistry::PHASE_MAINTENANCE);
+            TimelineSpan span("overdue-tasks", "maintenance");
+            reapWrites(false);
+            maintenance.runOverdue();
+        }
+        
         if (!handlerSuccess) {
             logProto(LOG_ERROR, "Handler failed for opcode %d", (int)opcode);
         }
@@ -490,6 +660,9 @@ bool CalibreProtocol::handleCardPrefix(json_object* args) {
 }
 
 void CalibreProtocol::disconnect() {
+    if (sessionClosed) return;
+    sessionClosed = true;
+    
     if (connected) {
         json_object* noopData = json_object_new_object();
         std::string noopStr = jsonToString(noopData);
@@ -503,9 +676,36 @@ void CalibreProtocol::disconnect() {
         currentBookFile = nullptr;
     }
     
-    if (cacheManager) {
-        cacheManager->saveCache();
-    }
+    // Nothing deferred may outlive the session
+    writer.endIngestBatch();
+    maintenance.runPending();
+    writer.drain();
+    reapWrites(true);
+    if (libraryNotifier) {
+        libraryNotifier->flush();
+        libraryNotifier->setGated(false);
+    }
+    bookManager->writeSqlProfile();
+    if (cacheManager) cacheManager->logSessionStats();
+    MetricsRegistry::instance().logSummary();
+    AllocTracker::logSummary();
+    MetricsRegistry::instance().writeJson(METRICS_PATH);
+    if (Timeline::instance().isEnabled()) Timeline::instance().writeJson(TIMELINE_PATH);
+    if (coverQueue) coverQueue->resume();
+}
+
+void CalibreProtocol::reconcileCache() {
+    if (!cacheManager) return;
+    
+    // Cached lpaths carry no storage, so a book may be on either one. Not
+    // getBookFilePath(): that follows the storage Calibre last targeted.
+    std::string mainRoot = bookManager->storageRoot(STORAGE_MAIN);
+    std::string cardRoot = bookManager->hasSDCard() ? bookManager->storageRoot(STORAGE_CARD) : "";
+    cacheManager->reconcile([&mainRoot, &cardRoot](const std::string& lpath) {
+        struct stat st;
+        if (stat((mainRoot + "/" + lpath).c_str(), &st) == 0) return true;
+        return !cardRoot.empty() && stat((cardRoot + "/" + lpath).c_str(), &st) == 0;
+    });
 }
 
 bool CalibreProtocol::handleSetCalibreInfo(json_object* args) {
@@ -550,6 +750,18 @@ bool CalibreProtocol::handleFreeSpace(json_object* args) {
 }
 
 bool CalibreProtocol::handleSetLibraryInfo(json_object* args) {
+    json_object* val = NULL;
+    std::string libraryUuid;
+    std::string libraryName;
+    if (json_object_object_get_ex(args, "libraryUuid", &val)) libraryUuid = safeGetJsonString(val);
+    if (json_object_object_get_ex(args, "libraryName", &val)) libraryName = safeGetJsonString(val);
+    logProto(LOG_INFO, "Library: %s (%s)", libraryName.c_str(), libraryUuid.c_str());
+    
+    // Cached uuids and timestamps are only valid for the library they came from
+    if (cacheManager && !libraryUuid.empty()) {
+        cacheManager->selectLibrary(libraryUuid);
+    }
+    
     json_object* response = json_object_new_object();
     bool result = sendOKResponse(response);
     freeJSON(response);
@@ -564,56 +776,34 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
         if (card) requestedCard = card;
     }
     
-    std::vector<BookMetadata> allBooks = bookManager->getAllBooks();
-    
-    sessionBooks.clear();
-    for (const auto& book : allBooks) {
-        std::string bookLocation = "main";
-        std::string fullPath = bookManager->getBookFilePath(book.lpath);
-        
-        if (fullPath.find(SDCARDDIR) == 0) {
-            bookLocation = "carda";
-        }
-        
-        if (requestedCard.empty()) {
-            if (bookLocation == "main") {
-                sessionBooks.push_back(book);
-            }
-        } else if (requestedCard == bookLocation) {
-            sessionBooks.push_back(book);
-        }
-    }
-    
-    int count = sessionBooks.size();
-    
     bool useCache = false;
     json_object* cacheObj = NULL;
     if (json_object_object_get_ex(args, "willUseCachedMetadata", &cacheObj)) {
         useCache = json_object_get_boolean(cacheObj);
     }
     
-    if (cacheManager) {
-        int matched = 0;
-        for (auto& book : sessionBooks) {
-            BookMetadata cachedMeta;
-            if (cacheManager->getCachedMetadata(book.lpath, cachedMeta)) {
-                bool usedCache = false;
-                
-                if (!cachedMeta.uuid.empty()) {
-                    book.uuid = cachedMeta.uuid;
-                    usedCache = true;
-                }
-                
-                if (!cachedMeta.lastModified.empty()) {
-                    book.lastModified = cachedMeta.lastModified;
-                }
-                
-                if (usedCache) matched++;
-            }
-        }
-        logProto(LOG_INFO, "UUID & Time Patching: %d/%d books matched in cache", matched, count);
+    // Rows are streamed from SQLite straight to the socket; only the
+    // session copy needed for later priKey/delete lookups is retained
+    int storageId = BookManager::storageIdForCard(requestedCard);
+    std::unique_ptr<BookCursor> cursor;
+    if (storageId > 0) {
+        cursor.reset(new BookCursor(bookManager, storageId));
     }
     
+    int count = cursor ? cursor->count() : 0;
+    
+    if (cacheManager && cacheManager->isLoading()) {
+        auto waitStart = std::chrono::steady_clock::now();
+        TimelineSpan span("wait-cache-load", "wait");
+        cacheManager->waitForLoad();
+        logProto(LOG_INFO, "Waited %lld ms for the metadata cache to load",
+                 (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - waitStart).count());
+    }
+    
+    sessionBooks.clear();
+    sessionBooks.reserve(count);
+    
     logProto(LOG_INFO, "GetBookCount for %s: %d books, useCache=%d", 
              requestedCard.empty() ? "main" : requestedCard.c_str(), count, useCache);
 
@@ -628,22 +818,66 @@ bool CalibreProtocol::handleGetBookCount(json_object* args) {
     }
     freeJSON(response);
     
+    BookMetadata book;
+    BookMetadata cachedMeta;
+    int matched = 0;
+    
     for (int i = 0; i < count; i++) {
+        if (!cursor->next(book)) {
+            // Calibre already has the count and waits for every row; a short
+            // list would stall it, so the session ends instead
+            logProto(LOG_ERROR, "Book list ended after %d of %d books", i, count);
+            errorMessage = "Failed to read the book list";
+            connected = false;
+            return false;
+        }
+        
+        if (cacheManager) cacheManager->notePresent(book.lpath);
+        if (cacheManager && cacheManager->getCachedMetadata(book.lpath, cachedMeta)) {
+            if (!cachedMeta.uuid.empty()) {
+                book.uuid = cachedMeta.uuid;
+                matched++;
+            }
+            
+            if (!cachedMeta.lastModified.empty()) {
+                book.lastModified = cachedMeta.lastModified;
+            }
+        }
+        
         json_object* bookJson = NULL;
         
         if (useCache) {
-            bookJson = cachedMetadataToJson(sessionBooks[i], i);
+            bookJson = cachedMetadataToJson(book, i);
         } else {
-            bookJson = metadataToJson(sessionBooks[i]);
+            bookJson = metadataToJson(book);
             json_object_object_add(bookJson, "priKey", json_object_new_int(i));
         }
         
         std::string bookStr = jsonToString(bookJson);
+        freeJSON(bookJson);
+        
         if (!network->sendJSON(OK, bookStr.c_str())) {
-            freeJSON(bookJson);
             return false;
         }
-        freeJSON(bookJson);
+        
+        sessionBooks.append(book, storageId);
+    }
+    
+    if (cacheManager) {
+        logProto(LOG_INFO, "UUID & Time Patching: %d/%d books matched in cache", matched, count);
+    }
+    
+    if (!sessionBooks.empty()) {
+        size_t catalogBytes = sessionBooks.bytesUsed();
+        logProto(LOG_INFO, "Session catalog: %d books, %u bytes (%u/book)",
+                 (int)sessionBooks.size(), (unsigned)catalogBytes,
+                 (unsigned)(catalogBytes / sessionBooks.size()));
+        
+        // The comparison walks every row, so it is only worked out for debugging
+        if (LOG_DEBUG >= LOG_MIN_LEVEL && logEnabled(LOG_DEBUG)) {
+            logProto(LOG_DEBUG, "Session catalog as vector<BookMetadata> would use %u/book",
+                     (unsigned)(sessionBooks.equivalentMetadataBytes() / sessionBooks.size()));
+        }
     }
     
     return true;
@@ -669,178 +903,30 @@ bool CalibreProtocol::handleSendBooklists(json_object* args) {
         return true;
     }
     
-    logProto(LOG_INFO, "Starting collection sync");
-    
-    std::map<std::string, std::set<std::string>> calibreCollections;
-    
+    // Lpaths are made absolute here, against the storage Calibre is
+    // talking to, before the sync is handed to the writer thread
+    CollectionList collections;
     json_object_object_foreach(collectionsObj, key, val) {
-        std::string cleanName = cleanCollectionName(key);
+        collections.push_back(std::make_pair(cleanCollectionName(key), std::vector<std::string>()));
+        std::vector<std::string>& members = collections.back().second;
         
-        std::set<std::string> lpaths;
         int arrayLen = json_object_array_length(val);
+        members.reserve(arrayLen);
         for (int i = 0; i < arrayLen; i++) {
-            json_object* lpathObj = json_object_array_get_idx(val, i);
-            lpaths.insert(json_object_get_string(lpathObj));
-        }
-        
-        calibreCollections[cleanName] = lpaths;
-        logProto(LOG_DEBUG, "Calibre collection '%s' has %d books", 
-                cleanName.c_str(), (int)lpaths.size());
-    }
-    
-    std::map<std::string, std::set<std::string>> deviceCollections;
-    sqlite3* db = bookManager->openDB();
-    if (!db) {
-        logProto(LOG_ERROR, "Failed to open DB for collection sync");
-        return false;
-    }
-    
-    const char* sql = 
-        "SELECT bs.name, f.filename, fo.name "
-        "FROM bookshelfs bs "
-        "JOIN bookshelfs_books bb ON bs.id = bb.bookshelfid "
-        "JOIN books_impl b ON bb.bookid = b.id "
-        "JOIN files f ON b.id = f.book_id "
-        "JOIN folders fo ON f.folder_id = fo.id "
-        "WHERE bs.is_deleted = 0 AND bb.is_deleted = 0";
-    
-    StmtHandle stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, stmt.ptr(), nullptr) == SQLITE_OK) {
-        while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
-            const char* shelfName = (const char*)sqlite3_column_text(stmt.get(), 0);
-            const char* fileName = (const char*)sqlite3_column_text(stmt.get(), 1);
-            const char* folderName = (const char*)sqlite3_column_text(stmt.get(), 2);
-            
-            if (shelfName && fileName && folderName) {
-                std::string fullPath = std::string(folderName) + "/" + fileName;
-                
-                std::string lpath = fullPath;
-                if (lpath.find("/mnt/ext1/") == 0) {
-                    lpath = lpath.substr(10);
-                }
-                
-                deviceCollections[shelfName].insert(lpath);
+            const char* lpath = json_object_get_string(json_object_array_get_idx(val, i));
+            if (lpath) {
+                members.push_back(bookManager->getBookFilePath(lpath));
             }
         }
     }
     
-    logProto(LOG_INFO, "Found %d collections on device", (int)deviceCollections.size());
+    logProto(LOG_INFO, "Starting collection sync (%d collections)", (int)collections.size());
     
-    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-    time_t now = time(NULL);
-    
-    for (const auto& calibreEntry : calibreCollections) {
-        const std::string& collectionName = calibreEntry.first;
-        const std::set<std::string>& calibreFiles = calibreEntry.second;
-        
-        int shelfId = bookManager->getOrCreateBookshelf(db, collectionName);
-        if (shelfId == -1) {
-            logProto(LOG_ERROR, "Failed to get/create shelf: %s", collectionName.c_str());
-            continue;
-        }
-        
-        auto deviceIt = deviceCollections.find(collectionName);
-        
-        if (deviceIt != deviceCollections.end()) {
-            const std::set<std::string>& deviceFiles = deviceIt->second;
-            
-            std::vector<std::string> toAdd;
-            std::set_difference(calibreFiles.begin(), calibreFiles.end(),
-                              deviceFiles.begin(), deviceFiles.end(),
-                              std::back_inserter(toAdd));
-            
-            std::vector<std::string> toRemove;
-            std::set_difference(deviceFiles.begin(), deviceFiles.end(),
-                              calibreFiles.begin(), calibreFiles.end(),
-                              std::back_inserter(toRemove));
-            
-            logProto(LOG_DEBUG, "Collection '%s': %d to add, %d to remove", 
-                    collectionName.c_str(), (int)toAdd.size(), (int)toRemove.size());
-            
-            if (!toAdd.empty()) {
-                const char* insertSql = 
-                    "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
-                    "VALUES (?, ?, 0, ?)";
-                StmtHandle insertStmt;
-                if (sqlite3_prepare_v2(db, insertSql, -1, insertStmt.ptr(), nullptr) == SQLITE_OK) {
-                    for (const std::string& lpath : toAdd) {
-                        int bookId = bookManager->findBookIdByPath(db, lpath);
-                        if (bookId != -1) {
-                            sqlite3_reset(insertStmt.get());
-                            sqlite3_bind_int(insertStmt.get(), 1, shelfId);
-                            sqlite3_bind_int(insertStmt.get(), 2, bookId);
-                            sqlite3_bind_int64(insertStmt.get(), 3, now);
-                            sqlite3_step(insertStmt.get());
-                        }
-                    }
-                }
-            }
-            
-            if (!toRemove.empty()) {
-                const char* deleteSql = 
-                    "UPDATE bookshelfs_books SET is_deleted = 1, ts = ? "
-                    "WHERE bookshelfid = ? AND bookid = ?";
-                StmtHandle deleteStmt;
-                if (sqlite3_prepare_v2(db, deleteSql, -1, deleteStmt.ptr(), nullptr) == SQLITE_OK) {
-                    for (const std::string& lpath : toRemove) {
-                        int bookId = bookManager->findBookIdByPath(db, lpath);
-                        if (bookId != -1) {
-                            sqlite3_reset(deleteStmt.get());
-                            sqlite3_bind_int64(deleteStmt.get(), 1, now);
-                            sqlite3_bind_int(deleteStmt.get(), 2, shelfId);
-                            sqlite3_bind_int(deleteStmt.get(), 3, bookId);
-                            sqlite3_step(deleteStmt.get());
-                        }
-                    }
-                }
-            }
-            
-            deviceCollections.erase(deviceIt);
-            
-        } else {
-            logProto(LOG_INFO, "Creating new collection: %s with %d books", 
-                    collectionName.c_str(), (int)calibreFiles.size());
-            
-            const char* insertSql = 
-                "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
-                "VALUES (?, ?, 0, ?)";
-            StmtHandle insertStmt;
-            if (sqlite3_prepare_v2(db, insertSql, -1, insertStmt.ptr(), nullptr) == SQLITE_OK) {
-                for (const std::string& lpath : calibreFiles) {
-                    int bookId = bookManager->findBookIdByPath(db, lpath);
-                    if (bookId != -1) {
-                        sqlite3_reset(insertStmt.get());
-                        sqlite3_bind_int(insertStmt.get(), 1, shelfId);
-                        sqlite3_bind_int(insertStmt.get(), 2, bookId);
-                        sqlite3_bind_int64(insertStmt.get(), 3, now);
-                        sqlite3_step(insertStmt.get());
-                    }
-                }
-            }
-        }
+    // Only one sync in flight: report the previous one before replacing it
+    if (pendingCollectionSync.valid()) {
+        reapWrites(true);
     }
-    
-    for (const auto& deviceEntry : deviceCollections) {
-        const std::string& collectionName = deviceEntry.first;
-        
-        logProto(LOG_INFO, "Removing collection no longer in Calibre: %s", 
-                collectionName.c_str());
-        
-        const char* deleteSql = "UPDATE bookshelfs SET is_deleted = 1, ts = ? WHERE name = ?";
-        StmtHandle deleteStmt;
-        if (sqlite3_prepare_v2(db, deleteSql, -1, deleteStmt.ptr(), nullptr) == SQLITE_OK) {
-            sqlite3_bind_int64(deleteStmt.get(), 1, now);
-            sqlite3_bind_text(deleteStmt.get(), 2, collectionName.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_step(deleteStmt.get());
-        }
-    }
-    
-    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
-    sqlite3_exec(db, "PRAGMA wal_checkpoint(FULL)", NULL, NULL, NULL);
-    
-    bookManager->closeDB(db);
-    
-    logProto(LOG_INFO, "Collection sync completed");
+    pendingCollectionSync = writer.syncCollections(std::move(collections));
     return true;
 }
 
@@ -929,6 +1015,52 @@ BookMetadata CalibreProtocol::jsonToMetadata(json_object* obj) {
     return metadata;
 }
 
+// Calibre sends "thumbnail": [width, height, base64 JPEG] sized to the
+// coverHeight we advertise
+static void readThumbnail(json_object* obj, BookMetadata& metadata) {
+    json_object* thumb = NULL;
+    if (!json_object_object_get_ex(obj, "thumbnail", &thumb) ||
+        json_object_get_type(thumb) != json_type_array ||
+        json_object_array_length(thumb) < 3) {
+        return;
+    }
+    
+    metadata.thumbnailWidth = json_object_get_int(json_object_array_get_idx(thumb, 0));
+    metadata.thumbnailHeight = json_object_get_int(json_object_array_get_idx(thumb, 1));
+    metadata.thumbnail = safeGetJsonString(json_object_array_get_idx(thumb, 2));
+}
+
+static bool base64Decode(const std::string& in, std::vector<unsigned char>& out) {
+    static signed char table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(table, -1, sizeof(table));
+        for (int i = 0; i < 64; i++) table[(unsigned char)alphabet[i]] = (signed char)i;
+        tableReady = true;
+    }
+    
+    out.clear();
+    out.reserve(in.size() * 3 / 4);
+    
+    unsigned int acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        unsigned char c = (unsigned char)in[i];
+        if (c == '=') break;
+        if (c == '\n' || c == '\r' || c == ' ') continue;
+        if (table[c] < 0) return false;
+        
+        acc = (acc << 6) | (unsigned int)table[c];
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((unsigned char)((acc >> bits) & 0xFF));
+        }
+    }
+    return !out.empty();
+}
+
 json_object* CalibreProtocol::metadataToJson(const BookMetadata& metadata) {
     json_object* obj = json_object_new_object();
     
@@ -955,28 +1087,45 @@ json_object* CalibreProtocol::metadataToJson(const BookMetadata& metadata) {
     return obj;
 }
 
-void CalibreProtocol::generateCoverCache(const std::string& filePath) {
-    logProto(LOG_INFO, "Generating cover for: %s", filePath.c_str());
-
-    ibitmap* cover = GetBookCover(filePath.c_str(), 
-                                  COVER_HEIGHT * 2/3, 
-                                  COVER_HEIGHT);
+void CalibreProtocol::queueCover(const std::string& filePath, const BookMetadata& metadata) {
+    if (!coverQueue) return;
     
-    if (cover) {
-        int result = CoverCachePut(CCS_FBREADER, filePath.c_str(), cover);
-        
-        if (result == 1) {
-            logProto(LOG_DEBUG, "Cover cache created successfully");
-        } else {
-            logProto(LOG_ERROR, "Failed to put cover into cache, code: %d", result);
-        }
-        
-        free(cover);
-    } else {
-        logProto(LOG_ERROR, "GetBookCover returned NULL. Parser failed or file locked.");
+    std::vector<unsigned char> jpeg;
+    if (!metadata.thumbnail.empty() && !base64Decode(metadata.thumbnail, jpeg)) {
+        logProto(LOG_ERROR, "Thumbnail is not valid base64");
+        jpeg.clear();
     }
+    if (!jpeg.empty()) {
+        logProto(LOG_DEBUG, "Queued %dx%d thumbnail (%d bytes)",
+                 metadata.thumbnailWidth, metadata.thumbnailHeight, (int)jpeg.size());
+    }
+    
+    coverQueue->enqueue(filePath, jpeg);
+    maintenance.markDirty(coverTask);
+}
 
-    BookReady(filePath.c_str());
+void CalibreProtocol::queueCoverBackfill() {
+    if (!coverQueue) return;
+    
+    // The queue skips books that already have a cover, so every book on
+    // the device is listed
+    std::vector<std::string> paths;
+    const int storages[] = { STORAGE_MAIN, STORAGE_CARD };
+    for (size_t i = 0; i < sizeof(storages) / sizeof(storages[0]); i++) {
+        if (storages[i] == STORAGE_CARD && !bookManager->hasSDCard()) continue;
+        
+        std::string root = bookManager->storageRoot(storages[i]);
+        bookManager->forEachBook(storages[i], [&paths, &root](const BookMetadata& book) {
+            if (!book.lpath.empty()) {
+                paths.push_back(book.lpath[0] == '/' ? book.lpath : root + "/" + book.lpath);
+            }
+            return true;
+        });
+    }
+    
+    logProto(LOG_INFO, "Cover backfill: checking %d books", (int)paths.size());
+    coverQueue->backfill(std::move(paths));
+    maintenance.markDirty(coverTask);
 }
 
 bool CalibreProtocol::handleSendBook(json_object* args) {
@@ -1060,6 +1209,8 @@ bool CalibreProtocol::handleSendBook(json_object* args) {
     
     logProto(LOG_DEBUG, "Starting binary transfer...");
     
+    // Receiving and writing interleave, so one span covers the whole file
+    long long fileStart = MetricsRegistry::nowMicros();
     while (currentBookReceived < currentBookLength) {
         size_t toRead = std::min((size_t)(currentBookLength - currentBookReceived), 
                                 (size_t)BASE_PACKET_LEN);
@@ -1089,14 +1240,22 @@ bool CalibreProtocol::handleSendBook(json_object* args) {
     logProto(LOG_INFO, "Transfer complete.");
     iv_fclose(currentBookFile);
     currentBookFile = nullptr;
+    Timeline::instance().addSpan("book-file", "file", fileStart,
+                                 MetricsRegistry::nowMicros() - fileStart, currentBookLpath);
     
-    bookManager->addBook(metadata);
+    PendingAdd pendingAdd;
+    pendingAdd.result = writer.addBook(metadata);
+    pendingAdd.lpath = metadata.lpath;
+    pendingAdds.push_back(std::move(pendingAdd));
     
     if (cacheManager) {
         cacheManager->updateCache(metadata);
     }
     
-    generateCoverCache(filePath);
+    // Only the cover needs the thumbnail, so it is not copied into the
+    // queued write or the cache
+    readThumbnail(metadataObj, metadata);
+    queueCover(filePath, metadata);
     
     booksReceivedInSession++;
     logProto(LOG_INFO, "Book added to DB and cache.");
@@ -1115,29 +1274,89 @@ bool CalibreProtocol::handleSendBookMetadata(json_object* args) {
     logProto(LOG_INFO, "Syncing metadata for: %s (Read: %d, Date: %s)", 
              metadata.title.c_str(), metadata.isRead, metadata.lastReadDate.c_str());
     
-    if (bookManager->updateBookSync(metadata)) {
-        for(auto& b : sessionBooks) {
-            if (b.lpath == metadata.lpath) { 
-                b.isRead = metadata.isRead;
-                b.isFavorite = metadata.isFavorite;
-                b.lastReadDate = metadata.lastReadDate;
-                b.series = metadata.series;
-                b.seriesIndex = metadata.seriesIndex;
-                break;
-            }
+    // The catalog and cache follow once the writer reports the book exists
+    PendingSync pending;
+    pending.result = writer.updateBookSync(metadata);
+    pending.metadata = metadata;
+    pendingSyncs.push_back(std::move(pending));
+    
+    return true;
+}
+
+void CalibreProtocol::takeNotifyRequest() {
+    if (libraryNotifier && libraryNotifier->takeFlushRequest()) {
+        maintenance.markDirty(libraryNotifyTask);
+    }
+}
+
+void CalibreProtocol::reapWrites(bool wait) {
+    // Checked first, so results reaped below wait for the next commit
+    if (pendingNotifyCommit.valid() &&
+        (wait || pendingNotifyCommit.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+        if (!pendingNotifyCommit.get()) {
+            logProto(LOG_ERROR, "Ingest group commit failed before library notify");
+        }
+        libraryNotifier->flush();
+    }
+    
+    size_t kept = 0;
+    for (size_t i = 0; i < pendingAdds.size(); i++) {
+        PendingAdd& pending = pendingAdds[i];
+        if (!wait && pending.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (kept != i) pendingAdds[kept] = std::move(pending);
+            kept++;
+            continue;
         }
         
-        if (cacheManager) {
-            cacheManager->updateCache(metadata);
+        if (!pending.result.get()) {
+            logProto(LOG_ERROR, "Book was not saved to the library: %s", pending.lpath.c_str());
+            if (cacheManager) cacheManager->removeFromCache(pending.lpath);
+        }
+    }
+    pendingAdds.erase(pendingAdds.begin() + kept, pendingAdds.end());
+    
+    kept = 0;
+    for (size_t i = 0; i < pendingSyncs.size(); i++) {
+        PendingSync& pending = pendingSyncs[i];
+        if (!wait && pending.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (kept != i) pendingSyncs[kept] = std::move(pending);
+            kept++;
+            continue;
         }
-
-		NotifyConfigChanged();
         
-    } else {
-        logProto(LOG_ERROR, "Warning: Attempted to sync metadata for non-existent book");
+        const BookMetadata& metadata = pending.metadata;
+        if (pending.result.get()) {
+            int index = sessionBooks.find(metadata.lpath);
+            if (index >= 0) {
+                sessionBooks.setSyncState(index, metadata.isRead, metadata.isFavorite, metadata.lastReadDate);
+                sessionBooks.setSeries(index, metadata.series, metadata.seriesIndex);
+            }
+            
+            if (cacheManager) {
+                cacheManager->updateCache(metadata);
+            }
+            
+            if (libraryNotifier) {
+                libraryNotifier->configChanged();
+                maintenance.markDirty(libraryNotifyTask);
+            } else {
+                NotifyConfigChanged();
+            }
+        } else {
+            logProto(LOG_ERROR, "Metadata sync was not saved: %s", metadata.lpath.c_str());
+        }
     }
+    pendingSyncs.erase(pendingSyncs.begin() + kept, pendingSyncs.end());
     
-    return true;
+    if (pendingCollectionSync.valid() &&
+        (wait || pendingCollectionSync.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+        if (pendingCollectionSync.get()) {
+            // The WAL checkpoint runs later from idle maintenance
+            logProto(LOG_INFO, "Collection sync completed");
+        } else {
+            logProto(LOG_ERROR, "Collection sync failed, changes rolled back");
+        }
+    }
 }
 
 bool CalibreProtocol::handleDeleteBook(json_object* args) {
@@ -1158,11 +1377,9 @@ bool CalibreProtocol::handleDeleteBook(json_object* args) {
         
         // Find UUID before deletion
         std::string deletedUuid = "";
-        for (const auto& book : sessionBooks) {
-            if (book.lpath == lpath) {
-                deletedUuid = book.uuid;
-                break;
-            }
+        int index = sessionBooks.find(lpath);
+        if (index >= 0) {
+            deletedUuid = sessionBooks.at(index).uuid();
         }
         
         // If not found in session, try cache
@@ -1191,7 +1408,7 @@ bool CalibreProtocol::handleDeleteBook(json_object* args) {
         logProto(LOG_DEBUG, "Deleting book %d/%d: %s", (int)i+1, count, lpath.c_str());
         
         // Perform deletion
-        bookManager->deleteBook(lpath);
+        writer.deleteBook(lpath);
         
         // Remove from cache
         if (cacheManager) {
@@ -1199,11 +1416,10 @@ bool CalibreProtocol::handleDeleteBook(json_object* args) {
         }
         
         // Remove from session books
-        sessionBooks.erase(
-            std::remove_if(sessionBooks.begin(), sessionBooks.end(),
-                [&lpath](const BookMetadata& b) { return b.lpath == lpath; }),
-            sessionBooks.end()
-        );
+        int index = sessionBooks.find(lpath);
+        if (index >= 0) {
+            sessionBooks.remove(index);
+        }
         
         // Send individual response for each deleted book
         json_object* response = json_object_new_object();
@@ -1293,9 +1509,10 @@ bool CalibreProtocol::handleNoop(json_object* args) {
         // logProto(LOG_DEBUG, "Calibre requested details for book index: %d", index);
         
         if (index >= 0 && index < (int)sessionBooks.size()) {
-            json_object* bookJson = metadataToJson(sessionBooks[index]);
+            BookMetadata book = sessionBooks.at(index).toMetadata();
+            json_object* bookJson = metadataToJson(book);
             
-            if (sessionBooks[index].isRead) {
+            if (book.isRead) {
                 json_object_object_add(bookJson, "_is_read_", json_object_new_boolean(true));
             }
             
@@ -1363,9 +1580,16 @@ json_object* CalibreProtocol::parseJSON(const std::string& jsonStr) {
 }
 
 void CalibreProtocol::freeJSON(json_object* obj) {
-    if (obj) {
+    if (!obj) return;
+    
+    // json-c bypasses operator new; what the release gives back is the DOM
+    if (AllocTracker::enabled()) {
+        long long before = AllocTracker::heapInUse();
         json_object_put(obj);
+        AllocTracker::noteJsonDom(before - AllocTracker::heapInUse());
+        return;
     }
+    json_object_put(obj);
 }
 
 json_object* CalibreProtocol::cachedMetadataToJson(const BookMetadata& metadata, int index) {
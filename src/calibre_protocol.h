@@ -4,7 +4,14 @@
 #include "network.h"
 #include "book_manager.h"
 #include "cache_manager.h"
+#include "cover_queue.h"
+#include "library_notifier.h"
+#include "book_catalog.h"
+#include "maintenance.h"
+#include "db_writer.h"
 #include <string>
+#include <vector>
+#include <future>
 #include <functional>
 #include <cstdio> 
 
@@ -13,7 +20,8 @@ struct json_object;
 class CalibreProtocol {
 public:
     CalibreProtocol(NetworkManager* network, BookManager* bookManager,
-                   CacheManager* cacheManager,
+                   CacheManager* cacheManager, CoverQueue* coverQueue,
+                   LibraryNotifier* libraryNotifier,
                    const std::string& readCol, 
                    const std::string& readDateCol, 
                    const std::string& favCol);
@@ -21,6 +29,8 @@ public:
     
     bool performHandshake(const std::string& password);
     void handleMessages(std::function<void(const std::string&)> statusCallback);
+    // Ends the session: flushes deferred writes and reports. Runs once, on
+    // the connection thread; later calls (the destructor's) do nothing.
     void disconnect();
     
     bool isConnected() const { return connected; }
@@ -34,9 +44,13 @@ private:
     NetworkManager* network;
     BookManager* bookManager;
     CacheManager* cacheManager;
+    CoverQueue* coverQueue;
+    LibraryNotifier* libraryNotifier;
     bool connected;
+    bool sessionClosed;
+    bool coverBackfillQueued;
     std::string errorMessage;
-    std::vector<BookMetadata> sessionBooks;
+    BookCatalog sessionBooks;
     
     // Calibre sync column configuration
     std::string readColumn;
@@ -56,6 +70,51 @@ private:
     // ДОБАВЛЕНО: Счетчик для текущей пачки передачи
     int lastBatchCount;
     
+    // All database writes run on the writer thread
+    DbWriter writer;
+    
+    // Metadata syncs whose catalog/cache update waits for the DB result
+    struct PendingSync {
+        std::future<bool> result;
+        BookMetadata metadata;
+    };
+    std::vector<PendingSync> pendingSyncs;
+    
+    // Received books are cached at once; an add that is not kept, alone or
+    // with its ingest group, is dropped from the cache again
+    struct PendingAdd {
+        std::future<bool> result;
+        std::string lpath;
+    };
+    std::vector<PendingAdd> pendingAdds;
+    std::future<bool> pendingCollectionSync;
+    std::future<bool> pendingNotifyCommit; // Library notifications wait for it
+    
+    // Applies finished write results; with `wait`, blocks for all of them
+    void reapWrites(bool wait);
+    
+    // Turns a flush request from the cover worker into a library-notify run
+    void takeNotifyRequest();
+    
+    // Drops cache entries for books that were not listed and are gone
+    void reconcileCache();
+    
+    // Housekeeping deferred to idle gaps between requests
+    MaintenanceScheduler maintenance;
+    int checkpointTask;
+    int cacheSaveTask;
+    int logFlushTask;
+    int ingestCommitTask;
+    int coverTask;
+    int coverBackfillTask;
+    int libraryNotifyTask;
+    int metricsTask;
+    
+    // Blocks until the next request arrives, running due maintenance
+    // tasks while the connection is quiet. False when nothing arrived
+    // within the receive timeout.
+    bool waitForRequest();
+    
     // Protocol handlers
     bool handleGetInitializationInfo(json_object* args);
     bool handleGetDeviceInformation(json_object* args);
@@ -86,7 +145,12 @@ private:
     void freeJSON(json_object* obj);
     std::string parseJsonStringOrArray(json_object* val);
 	
-    void generateCoverCache(const std::string& filePath);
+    // Hands the book to the cover queue with the thumbnail Calibre sent,
+    // if any; the queue parses the book only as a fallback
+    void queueCover(const std::string& filePath, const BookMetadata& metadata);
+    
+    // Lists every book on the device for the cover queue to backfill
+    void queueCoverBackfill();
     
     // Metadata conversion
     BookMetadata jsonToMetadata(json_object* obj);
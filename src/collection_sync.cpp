@@ -0,0 +1,206 @@
+#include "collection_sync.h"
+#include "logger.h"
+#include <cstdio>
+#include <ctime>
+#include <chrono>
+
+#define LOG_SYNC(...) LOG_AT(LOG_INFO, "SYNC", __VA_ARGS__)
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --- Staging ---
+
+static const char* CREATE_STAGING_SQL =
+    "CREATE TEMP TABLE IF NOT EXISTS calibre_shelves (name TEXT PRIMARY KEY);"
+    "CREATE TEMP TABLE IF NOT EXISTS calibre_links (name TEXT, bookid INTEGER, PRIMARY KEY (name, bookid));"
+    "DELETE FROM temp.calibre_shelves;"
+    "DELETE FROM temp.calibre_links;";
+
+static const char* DROP_STAGING_SQL =
+    "DROP TABLE IF EXISTS temp.calibre_shelves;"
+    "DROP TABLE IF EXISTS temp.calibre_links;";
+
+// --- Diff statements (?1 = timestamp) ---
+
+// Shelves Calibre has that the device never had
+static const char* CREATE_SHELVES_SQL =
+    "INSERT INTO bookshelfs (name, is_deleted, ts) "
+    "SELECT c.name, 0, ?1 FROM temp.calibre_shelves c "
+    "WHERE NOT EXISTS (SELECT 1 FROM bookshelfs s WHERE s.name = c.name)";
+
+// Soft-deleted shelves that are back in Calibre. Live shelves are untouched.
+static const char* RESTORE_SHELVES_SQL =
+    "UPDATE bookshelfs SET is_deleted = 0, ts = ?1 "
+    "WHERE is_deleted != 0 AND name IN (SELECT name FROM temp.calibre_shelves)";
+
+static const char* RESTORE_LINKS_SQL =
+    "UPDATE bookshelfs_books SET is_deleted = 0, ts = ?1 "
+    "WHERE is_deleted != 0 AND EXISTS ("
+    "  SELECT 1 FROM temp.calibre_links l JOIN bookshelfs s ON s.name = l.name "
+    "  WHERE s.id = bookshelfs_books.bookshelfid AND l.bookid = bookshelfs_books.bookid)";
+
+static const char* ADD_LINKS_SQL =
+    "INSERT OR IGNORE INTO bookshelfs_books (bookshelfid, bookid, is_deleted, ts) "
+    "SELECT s.id, l.bookid, 0, ?1 FROM temp.calibre_links l "
+    "JOIN bookshelfs s ON s.name = l.name "
+    "WHERE NOT EXISTS (SELECT 1 FROM bookshelfs_books bb "
+    "                  WHERE bb.bookshelfid = s.id AND bb.bookid = l.bookid)";
+
+// Links on synced shelves whose book is on the device but no longer in the
+// Calibre collection
+static const char* REMOVE_LINKS_SQL =
+    "UPDATE bookshelfs_books SET is_deleted = 1, ts = ?1 "
+    "WHERE is_deleted = 0 "
+    "AND bookshelfid IN (SELECT s.id FROM bookshelfs s JOIN temp.calibre_shelves c ON c.name = s.name) "
+    "AND bookid IN (SELECT book_id FROM files) "
+    "AND NOT EXISTS ("
+    "  SELECT 1 FROM temp.calibre_links l JOIN bookshelfs s ON s.name = l.name "
+    "  WHERE s.id = bookshelfs_books.bookshelfid AND l.bookid = bookshelfs_books.bookid)";
+
+// Live shelves holding device books that Calibre no longer has
+static const char* DELETE_SHELVES_SQL =
+    "UPDATE bookshelfs SET is_deleted = 1, ts = ?1 "
+    "WHERE is_deleted = 0 "
+    "AND name NOT IN (SELECT name FROM temp.calibre_shelves) "
+    "AND EXISTS (SELECT 1 FROM bookshelfs_books bb JOIN files f ON f.book_id = bb.bookid "
+    "            WHERE bb.bookshelfid = bookshelfs.id AND bb.is_deleted = 0)";
+
+CollectionSync::CollectionSync(BookManager* bookManager, sqlite3* database)
+    : db(database), resolver(bookManager), insertShelf(nullptr), insertLink(nullptr),
+      active(false), phaseStart(0) {
+}
+
+CollectionSync::~CollectionSync() {
+    finalizeStatements();
+    if (active) {
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        sqlite3_exec(db, DROP_STAGING_SQL, NULL, NULL, NULL);
+    }
+}
+
+void CollectionSync::finalizeStatements() {
+    if (insertShelf) {
+        sqlite3_finalize(insertShelf);
+        insertShelf = nullptr;
+    }
+    if (insertLink) {
+        sqlite3_finalize(insertLink);
+        insertLink = nullptr;
+    }
+}
+
+bool CollectionSync::begin() {
+    phaseStart = monotonicMs();
+
+    if (sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_SYNC("Failed to begin transaction: %s", sqlite3_errmsg(db));
+        return false;
+    }
+    active = true;
+
+    if (sqlite3_exec(db, CREATE_STAGING_SQL, NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_SYNC("Failed to create staging tables: %s", sqlite3_errmsg(db));
+        return false;
+    }
+
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO temp.calibre_shelves (name) VALUES (?)",
+                           -1, &insertShelf, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO temp.calibre_links (name, bookid) VALUES (?, ?)",
+                           -1, &insertLink, nullptr) != SQLITE_OK) {
+        LOG_SYNC("Failed to prepare staging inserts: %s", sqlite3_errmsg(db));
+        return false;
+    }
+
+    // Same connection as the diff, so books from the ingest group that was
+    // just committed resolve too
+    return resolver.load(db);
+}
+
+void CollectionSync::addCollection(const std::string& name) {
+    if (!insertShelf) return;
+
+    sqlite3_reset(insertShelf);
+    sqlite3_bind_text(insertShelf, 1, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_step(insertShelf);
+    stats.collections++;
+}
+
+void CollectionSync::addMember(const std::string& collection, const std::string& lpath) {
+    if (!insertLink) return;
+
+    int bookId = resolver.resolve(lpath);
+    if (bookId == -1) {
+        stats.unresolved++;
+        return;
+    }
+
+    sqlite3_reset(insertLink);
+    sqlite3_bind_text(insertLink, 1, collection.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(insertLink, 2, bookId);
+    sqlite3_step(insertLink);
+    stats.members++;
+}
+
+int CollectionSync::execChanges(const char* sql, long long now) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        LOG_SYNC("Failed to prepare diff statement: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    sqlite3_bind_int64(stmt, 1, now);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        LOG_SYNC("Diff statement failed: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+    return sqlite3_changes(db);
+}
+
+bool CollectionSync::commit() {
+    if (!active) return false;
+
+    finalizeStatements();
+
+    long long diffStart = monotonicMs();
+    stats.loadMs = (long)(diffStart - phaseStart);
+
+    long long now = time(NULL);
+
+    // Order matters: shelves must exist before links are added, and
+    // removals must see the links that were just added or restored
+    if ((stats.shelvesCreated = execChanges(CREATE_SHELVES_SQL, now)) < 0 ||
+        (stats.shelvesRestored = execChanges(RESTORE_SHELVES_SQL, now)) < 0 ||
+        (stats.linksRestored = execChanges(RESTORE_LINKS_SQL, now)) < 0 ||
+        (stats.linksAdded = execChanges(ADD_LINKS_SQL, now)) < 0 ||
+        (stats.linksRemoved = execChanges(REMOVE_LINKS_SQL, now)) < 0 ||
+        (stats.shelvesDeleted = execChanges(DELETE_SHELVES_SQL, now)) < 0) {
+        return false; // Destructor rolls back
+    }
+
+    long long commitStart = monotonicMs();
+    stats.diffMs = (long)(commitStart - diffStart);
+
+    sqlite3_exec(db, DROP_STAGING_SQL, NULL, NULL, NULL);
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_SYNC("Commit failed: %s", sqlite3_errmsg(db));
+        return false;
+    }
+    active = false;
+
+    stats.commitMs = (long)(monotonicMs() - commitStart);
+
+    LOG_SYNC("Collections: %d, links staged: %d, unresolved lpaths: %d",
+             stats.collections, stats.members, stats.unresolved);
+    LOG_SYNC("Shelves: +%d created, %d restored, %d deleted; links: +%d added, %d restored, %d removed",
+             stats.shelvesCreated, stats.shelvesRestored, stats.shelvesDeleted,
+             stats.linksAdded, stats.linksRestored, stats.linksRemoved);
+    LOG_SYNC("Timings: load %ld ms, diff %ld ms, commit %ld ms",
+             stats.loadMs, stats.diffMs, stats.commitMs);
+    return true;
+}
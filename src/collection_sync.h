@@ -0,0 +1,67 @@
+#ifndef COLLECTION_SYNC_H
+#define COLLECTION_SYNC_H
+
+#include "book_manager.h"
+#include <string>
+#include <sqlite3.h>
+
+// Reconciles PocketBook bookshelves with Calibre collections inside SQLite.
+// Calibre's membership is staged in temporary tables, then shelves and
+// links are added, revived and removed by a handful of set-based
+// statements in a single transaction.
+//
+// Usage: begin(), addCollection()/addMember() for every entry, commit().
+class CollectionSync {
+public:
+    struct Stats {
+        int collections;
+        int members;
+        int unresolved;
+        int shelvesCreated;
+        int shelvesRestored;
+        int shelvesDeleted;
+        int linksAdded;
+        int linksRestored;
+        int linksRemoved;
+        long loadMs;
+        long diffMs;
+        long commitMs;
+
+        Stats() : collections(0), members(0), unresolved(0),
+                  shelvesCreated(0), shelvesRestored(0), shelvesDeleted(0),
+                  linksAdded(0), linksRestored(0), linksRemoved(0),
+                  loadMs(0), diffMs(0), commitMs(0) {}
+    };
+
+    CollectionSync(BookManager* bookManager, sqlite3* db);
+    ~CollectionSync();
+
+    // Opens the transaction, prepares the staging tables and loads the
+    // lpath resolver
+    bool begin();
+
+    void addCollection(const std::string& name);
+    void addMember(const std::string& collection, const std::string& lpath);
+
+    // Applies the diff and commits. Rolls back on failure.
+    bool commit();
+
+    const Stats& getStats() const { return stats; }
+
+private:
+    sqlite3* db;
+    BookIdResolver resolver;
+    sqlite3_stmt* insertShelf;
+    sqlite3_stmt* insertLink;
+    bool active;
+    Stats stats;
+    long long phaseStart;
+
+    int execChanges(const char* sql, long long now);
+    void finalizeStatements();
+
+    CollectionSync(const CollectionSync&);
+    CollectionSync& operator=(const CollectionSync&);
+};
+
+#endif // COLLECTION_SYNC_H
@@ -0,0 +1,368 @@
+#include "cover_queue.h"
+#include "logger.h"
+#include "library_notifier.h"
+#include "metrics.h"
+#include "timeline.h"
+#include "inkview.h"
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdarg>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Lines are "A <id> <book path>" when a job is accepted and "D <id>" when
+// it is finished; the file is rewritten with only the open jobs at start
+static const char* JOURNAL_PATH = "/mnt/ext1/system/calibre-connect-covers.queue";
+static const char* SPOOL_DIR = "/mnt/ext1/system/calibre-connect-covers";
+
+// Above the protocol and DB writer threads, which run at the default 0
+static const int WORKER_NICE = 10;
+
+// Backfill renders at most one cover per gap, leaving the CPU and the SD
+// card mostly to the library view the user may be browsing
+static const int BACKFILL_GAP_MS = 500;
+
+// Backfilled covers are announced to the library in groups this size
+static const int BACKFILL_NOTIFY_BATCH = 20;
+
+static const int JPEG_BRIGHTNESS = 100;
+static const int JPEG_CONTRAST = 100;
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CoverQueue::CoverQueue(LibraryNotifier* libraryNotifier)
+    : notifier(libraryNotifier), backfillNext(0), journal(nullptr), nextId(1), running(false), stopping(false), paused(false),
+      rendered(0), renderMs(0), backfillChecked(0), backfillRendered(0), backfillUnannounced(0), backfillStartMs(0) {
+    memset(&progress, 0, sizeof(progress));
+}
+
+CoverQueue::~CoverQueue() {
+    stop();
+}
+
+void CoverQueue::start(ProgressCallback onProgress) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) return;
+
+    progressCallback = onProgress;
+    loadJournal();
+
+    running = true;
+    stopping = false;
+    worker = std::thread(&CoverQueue::run, this);
+}
+
+void CoverQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+    requestNotificationFlush();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    if (journal) {
+        fclose(journal);
+        journal = nullptr;
+    }
+    logMsg("Cover queue stopped: %lld covers in %lld ms, %d left for next start",
+           rendered, renderMs, (int)jobs.size());
+}
+
+std::string CoverQueue::spoolPath(long id) const {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%ld.jpg", SPOOL_DIR, id);
+    return path;
+}
+
+void CoverQueue::loadJournal() {
+    std::map<long, std::string> open;
+
+    FILE* f = fopen(JOURNAL_PATH, "r");
+    if (f) {
+        char line[1024];
+        while (fgets(line, sizeof(line), f)) {
+            size_t len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+
+            char* rest = nullptr;
+            long id = (len > 2) ? strtol(line + 2, &rest, 10) : 0;
+            if (id <= 0) continue; // Torn or garbled line
+            if (id >= nextId) nextId = id + 1;
+
+            if (line[0] == 'A' && *rest == ' ' && rest[1]) {
+                open[id] = rest + 1;
+            } else if (line[0] == 'D') {
+                open.erase(id);
+            }
+        }
+        fclose(f);
+    }
+
+    // Compact: keep only the jobs that are still open
+    journal = fopen(JOURNAL_PATH, "w");
+    for (auto it = open.begin(); it != open.end(); ++it) {
+        Job job;
+        job.id = it->first;
+        job.filePath = it->second;
+        jobs.push_back(job);
+        if (journal) fprintf(journal, "A %ld %s\n", job.id, job.filePath.c_str());
+    }
+    if (journal) fflush(journal);
+
+    // Thumbnails whose job finished, or never made it into the journal
+    mkdir(SPOOL_DIR, 0755);
+    DIR* dir = opendir(SPOOL_DIR);
+    if (dir) {
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL) {
+            long id = atol(ent->d_name);
+            if (id > 0 && open.find(id) == open.end()) {
+                unlink(spoolPath(id).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    progress.queued = (int)jobs.size();
+    progress.pending = progress.queued;
+    if (!jobs.empty()) {
+        logMsg("Cover queue: resuming %d unfinished covers", (int)jobs.size());
+    }
+}
+
+void CoverQueue::appendJournal(const char* format, ...) {
+    if (!journal) return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(journal, format, args);
+    va_end(args);
+    fputc('\n', journal);
+    fflush(journal);
+}
+
+void CoverQueue::enqueue(const std::string& filePath, const std::vector<unsigned char>& thumbnail) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    Job job;
+    job.id = nextId++;
+    job.filePath = filePath;
+
+    // Spooled before the job is journaled, so a journaled job never
+    // points at a half-written thumbnail
+    if (!thumbnail.empty()) {
+        TimelineSpan span("thumbnail-spool", "file", filePath);
+        std::string path = spoolPath(job.id);
+        FILE* f = fopen(path.c_str(), "wb");
+        bool written = f && fwrite(thumbnail.data(), 1, thumbnail.size(), f) == thumbnail.size();
+        if (f) fclose(f);
+        if (!written) {
+            logMsg("Cover queue: cannot spool thumbnail for %s", filePath.c_str());
+            unlink(path.c_str());
+        }
+    }
+
+    appendJournal("A %ld %s", job.id, filePath.c_str());
+    jobs.push_back(job);
+    progress.queued++;
+    progress.pending++;
+    lock.unlock();
+
+    wake.notify_one();
+}
+
+void CoverQueue::backfill(std::vector<std::string> filePaths) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        backfillPaths.swap(filePaths);
+        backfillNext = 0;
+        backfillChecked = 0;
+        backfillRendered = 0;
+        backfillStartMs = monotonicMs();
+    }
+    wake.notify_one();
+}
+
+void CoverQueue::pause() {
+    std::lock_guard<std::mutex> lock(mutex);
+    paused = true;
+}
+
+void CoverQueue::resume() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!paused) return;
+        paused = false;
+    }
+    wake.notify_one();
+}
+
+CoverQueue::Progress CoverQueue::getProgress() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return progress;
+}
+
+bool CoverQueue::hasPending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hasWork();
+}
+
+void CoverQueue::requestNotificationFlush() {
+    if (notifier) notifier->requestFlush();
+}
+
+bool CoverQueue::hasWork() const {
+    return !jobs.empty() || backfillNext < backfillPaths.size();
+}
+
+void CoverQueue::run() {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), WORKER_NICE);
+    Timeline::instance().setThreadName("covers");
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        wake.wait(lock, [this]() { return stopping || (!paused && hasWork()); });
+        if (stopping) break;
+
+        if (!jobs.empty()) {
+            runJob(lock);
+        } else {
+            runBackfill(lock);
+        }
+    }
+}
+
+void CoverQueue::runJob(std::unique_lock<std::mutex>& lock) {
+    // Stays at the front until it is done, so stop() leaves it journaled
+    Job job = jobs.front();
+    lock.unlock();
+
+    long long start = monotonicMs();
+    bool ok = render(job.filePath, spoolPath(job.id));
+    long long elapsed = monotonicMs() - start;
+
+    lock.lock();
+    jobs.pop_front();
+    appendJournal("D %ld", job.id);
+    rendered++;
+    renderMs += elapsed;
+    if (ok) progress.done++; else progress.failed++;
+    progress.pending = (int)jobs.size();
+    Progress snapshot = progress;
+
+    if (jobs.empty()) {
+        logMsg("Cover queue drained: %d done, %d failed", progress.done, progress.failed);
+        memset(&progress, 0, sizeof(progress));
+        if (journal) {
+            // Nothing open: start the next batch from an empty journal
+            fclose(journal);
+            journal = fopen(JOURNAL_PATH, "w");
+        }
+    }
+
+    bool batchDone = jobs.empty();
+    ProgressCallback callback = progressCallback;
+    lock.unlock();
+    if (batchDone) requestNotificationFlush();
+    if (callback) callback(snapshot);
+    lock.lock();
+}
+
+void CoverQueue::runBackfill(std::unique_lock<std::mutex>& lock) {
+    std::string filePath = backfillPaths[backfillNext++];
+    bool skip = backfillFailed.count(filePath) != 0;
+    lock.unlock();
+
+    bool renderedOne = false;
+    if (!skip) {
+        ibitmap* cached = CoverCacheGet(CCS_FBREADER, filePath.c_str());
+        if (cached) {
+            free(cached);
+        } else {
+            long long start = monotonicMs();
+            bool ok = render(filePath, "");
+            long long elapsed = monotonicMs() - start;
+            renderedOne = true;
+
+            lock.lock();
+            rendered++;
+            renderMs += elapsed;
+            if (ok) backfillRendered++; else backfillFailed.insert(filePath);
+            bool batchDone = ++backfillUnannounced >= BACKFILL_NOTIFY_BATCH;
+            if (batchDone) backfillUnannounced = 0;
+            lock.unlock();
+            if (batchDone) requestNotificationFlush();
+        }
+    }
+
+    lock.lock();
+    backfillChecked++;
+    if (backfillNext >= backfillPaths.size()) {
+        logMsg("Cover backfill: %d books checked, %d covers rendered, %d failed so far, %lld ms",
+               backfillChecked, backfillRendered, (int)backfillFailed.size(),
+               monotonicMs() - backfillStartMs);
+        std::vector<std::string>().swap(backfillPaths);
+        backfillNext = 0;
+        backfillUnannounced = 0;
+        lock.unlock();
+        requestNotificationFlush();
+        lock.lock();
+        return;
+    }
+
+    // Throttle, but give way at once to a request, a received book or stop()
+    if (renderedOne) {
+        wake.wait_for(lock, std::chrono::milliseconds(BACKFILL_GAP_MS),
+                      [this]() { return stopping || paused || !jobs.empty(); });
+    }
+}
+
+bool CoverQueue::render(const std::string& filePath, const std::string& thumbPath) {
+    PhaseTimer timer(MetricsRegistry::PHASE_COVER);
+    TimelineSpan span("cover", "cover", filePath);
+    ibitmap* cover = nullptr;
+
+    // Calibre's thumbnail, scaled proportionally into the same box
+    // GetBookCover renders. InkView only loads JPEG from a path.
+    if (!thumbPath.empty() && access(thumbPath.c_str(), R_OK) == 0) {
+        cover = LoadJPEG(thumbPath.c_str(), COVER_WIDTH, COVER_HEIGHT,
+                         JPEG_BRIGHTNESS, JPEG_CONTRAST, 1);
+        unlink(thumbPath.c_str());
+    }
+    if (!cover) {
+        // No usable thumbnail: render from the book itself
+        cover = GetBookCover(filePath.c_str(), COVER_WIDTH, COVER_HEIGHT);
+    }
+
+    bool ok = false;
+    if (cover) {
+        int result = CoverCachePut(CCS_FBREADER, filePath.c_str(), cover);
+        ok = (result == 1);
+        if (!ok) {
+            logMsg("Cover queue: CoverCachePut failed for %s, code: %d", filePath.c_str(), result);
+        }
+        free(cover);
+    } else {
+        logMsg("Cover queue: no cover for %s. Parser failed or file locked.", filePath.c_str());
+    }
+
+    if (notifier) {
+        notifier->bookReady(filePath);
+    } else {
+        BookReady(filePath.c_str());
+    }
+    return ok;
+}
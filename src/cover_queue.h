@@ -0,0 +1,120 @@
+#ifndef COVER_QUEUE_H
+#define COVER_QUEUE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <cstdio>
+
+class LibraryNotifier;
+
+// Renders cover cache entries for received books on a low-priority thread,
+// so SEND_BOOK does not wait for the JPEG decoder or the book parser.
+//
+// Every job is journaled to calibre-connect-covers.queue before it is
+// accepted and marked done once its cover is in the cache; jobs left in
+// the journal are picked up again at the next start. Calibre thumbnails
+// are spooled next to the journal so a resumed job still has them.
+//
+// The worker only runs while the queue is resumed. The protocol pauses it
+// for each request and resumes it once the connection goes quiet.
+//
+// When no journaled job is left the worker backfills covers for books
+// already in the library, one every BACKFILL_GAP_MS at most. Backfill is
+// not journaled; the protocol hands over a fresh list every session.
+class CoverQueue {
+public:
+    // Cover size advertised to Calibre and rendered for the cache
+    static const int COVER_HEIGHT = 240;
+    static const int COVER_WIDTH = COVER_HEIGHT * 2 / 3;
+
+    // Counts since the queue last drained; `pending` is what is left
+    struct Progress {
+        int queued;
+        int done;
+        int failed;
+        int pending;
+    };
+    typedef std::function<void(const Progress&)> ProgressCallback;
+
+    // BookReady() for finished covers goes through `notifier`; the queue
+    // asks for a flush when a batch of jobs or a backfill pass is done,
+    // which a connected session defers until its writes have committed
+    explicit CoverQueue(LibraryNotifier* notifier);
+    ~CoverQueue();
+
+    // Loads unfinished jobs from the journal and starts the worker.
+    // `onProgress` runs on the worker thread after every job.
+    void start(ProgressCallback onProgress);
+
+    // Finishes the current job and joins; pending jobs stay journaled
+    void stop();
+
+    // `thumbnail` is the decoded Calibre JPEG, empty to parse the book
+    void enqueue(const std::string& filePath, const std::vector<unsigned char>& thumbnail);
+
+    // Replaces the backfill list. Books that already have a cached cover,
+    // or whose cover failed earlier in this run, are skipped.
+    void backfill(std::vector<std::string> filePaths);
+
+    // Pausing does not interrupt a cover that is already being rendered
+    void pause();
+    void resume();
+
+    Progress getProgress() const;
+
+    // True while journaled jobs or backfill remain
+    bool hasPending() const;
+
+private:
+    struct Job {
+        long id;
+        std::string filePath;
+    };
+
+    LibraryNotifier* notifier;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    std::vector<std::string> backfillPaths;
+    size_t backfillNext;
+    std::unordered_set<std::string> backfillFailed;
+    std::thread worker;
+    FILE* journal;
+    ProgressCallback progressCallback;
+    long nextId;
+    bool running;
+    bool stopping;
+    bool paused;
+
+    Progress progress;
+
+    // Totals for the log
+    long long rendered;
+    long long renderMs;
+    int backfillChecked;
+    int backfillRendered;
+    int backfillUnannounced;
+    long long backfillStartMs;
+
+    void loadJournal();
+    void appendJournal(const char* format, ...);
+    std::string spoolPath(long id) const;
+    bool hasWork() const;
+    void requestNotificationFlush();
+    bool render(const std::string& filePath, const std::string& thumbPath);
+    void runJob(std::unique_lock<std::mutex>& lock);
+    void runBackfill(std::unique_lock<std::mutex>& lock);
+    void run();
+
+    CoverQueue(const CoverQueue&);
+    CoverQueue& operator=(const CoverQueue&);
+};
+
+#endif // COVER_QUEUE_H
@@ -0,0 +1,213 @@
+#include "db_writer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timeline.h"
+#include <chrono>
+
+// Timeline span names, by CommandType
+static const char* COMMAND_NAMES[] = {
+    "db-add-book", "db-update-sync", "db-delete-book", "db-sync-collections",
+    "db-begin-batch", "db-end-batch", "db-flush-group", "db-checkpoint"
+};
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+DbWriter::DbWriter(BookManager* manager, size_t queueCapacity)
+    : bookManager(manager), capacity(queueCapacity > 0 ? queueCapacity : 1),
+      running(false), stopping(false), busy(false),
+      executed(0), producerWaitMs(0), highWater(0) {
+}
+
+DbWriter::~DbWriter() {
+    stop();
+}
+
+void DbWriter::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) return;
+
+    running = true;
+    stopping = false;
+    worker = std::thread(&DbWriter::run, this);
+}
+
+void DbWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        stopping = true;
+    }
+    notEmpty.notify_all();
+    worker.join();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    logMsg("DB writer stopped: %lld commands, queue high-water %d/%d, producer waited %lld ms",
+           executed, (int)highWater, (int)capacity, producerWaitMs);
+}
+
+std::future<bool> DbWriter::submit(Command* command) {
+    std::unique_ptr<Command> owned(command);
+    std::future<bool> result = owned->result.get_future();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running || stopping) {
+        // No thread to hand it to: run on the caller's thread instead
+        lock.unlock();
+        owned->result.set_value(execute(*owned));
+        return result;
+    }
+
+    if (queue.size() >= capacity) {
+        TimelineSpan span("wait-db-queue", "wait");
+        long long waitStart = monotonicMs();
+        notFull.wait(lock, [this]() { return queue.size() < capacity; });
+        producerWaitMs += monotonicMs() - waitStart;
+    }
+
+    queue.push_back(std::move(owned));
+    if (queue.size() > highWater) highWater = queue.size();
+    lock.unlock();
+
+    notEmpty.notify_one();
+    return result;
+}
+
+void DbWriter::drain() {
+    TimelineSpan span("wait-db-drain", "wait");
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return queue.empty() && !busy; });
+}
+
+void DbWriter::run() {
+    Timeline::instance().setThreadName("db-writer");
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        notEmpty.wait(lock, [this]() { return !queue.empty() || stopping; });
+        if (queue.empty()) break; // Stopping and drained
+
+        std::unique_ptr<Command> command = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+        lock.unlock();
+        notFull.notify_one();
+
+        bool ok = execute(*command);
+        settle(std::move(command), ok);
+
+        lock.lock();
+        busy = false;
+        executed++;
+        if (queue.empty()) idle.notify_all();
+    }
+
+    // The connection belongs to this thread; close it before leaving
+    lock.unlock();
+    bookManager->closeWriter();
+    releaseHeld();
+    lock.lock();
+    idle.notify_all();
+}
+
+void DbWriter::settle(std::unique_ptr<Command> command, bool ok) {
+    bool isWrite = command->type == CMD_ADD_BOOK || command->type == CMD_UPDATE_SYNC ||
+                   command->type == CMD_DELETE_BOOK;
+    if (ok && isWrite && bookManager->isIngestGroupOpen()) {
+        held.push_back(std::move(command));
+        return;
+    }
+
+    // Whatever closed the group, the writes held for it go first
+    if (!bookManager->isIngestGroupOpen()) releaseHeld();
+    command->result.set_value(ok);
+}
+
+void DbWriter::releaseHeld() {
+    if (held.empty()) return;
+
+    bool committed = bookManager->lastIngestGroupCommitted();
+    if (!committed) {
+        logMsg("DB writer: %d writes lost with their ingest group", (int)held.size());
+    }
+    for (size_t i = 0; i < held.size(); i++) {
+        held[i]->result.set_value(committed);
+    }
+    held.clear();
+}
+
+bool DbWriter::execute(Command& command) {
+    PhaseTimer timer(MetricsRegistry::PHASE_SQLITE);
+    TimelineSpan span(COMMAND_NAMES[command.type], "sqlite",
+                      command.type == CMD_DELETE_BOOK ? command.lpath : command.metadata.lpath);
+    switch (command.type) {
+        case CMD_ADD_BOOK:
+            return bookManager->addBook(command.metadata);
+        case CMD_UPDATE_SYNC:
+            return bookManager->updateBookSync(command.metadata);
+        case CMD_DELETE_BOOK:
+            return bookManager->deleteBook(command.lpath);
+        case CMD_SYNC_COLLECTIONS:
+            return bookManager->syncCollections(command.collections);
+        case CMD_BEGIN_BATCH:
+            bookManager->beginIngestBatch(command.maxBooks, command.maxSeconds);
+            return true;
+        case CMD_END_BATCH:
+            return bookManager->endIngestBatch();
+        case CMD_FLUSH_GROUP:
+            return bookManager->flushIngestGroup();
+        case CMD_CHECKPOINT:
+            return bookManager->checkpoint();
+    }
+    return false;
+}
+
+// --- Commands ---
+
+std::future<bool> DbWriter::addBook(const BookMetadata& metadata) {
+    Command* command = new Command(CMD_ADD_BOOK);
+    command->metadata = metadata;
+    command->metadata.lpath = bookManager->getBookFilePath(metadata.lpath);
+    return submit(command);
+}
+
+std::future<bool> DbWriter::updateBookSync(const BookMetadata& metadata) {
+    Command* command = new Command(CMD_UPDATE_SYNC);
+    command->metadata = metadata;
+    command->metadata.lpath = bookManager->getBookFilePath(metadata.lpath);
+    return submit(command);
+}
+
+std::future<bool> DbWriter::deleteBook(const std::string& lpath) {
+    Command* command = new Command(CMD_DELETE_BOOK);
+    command->lpath = bookManager->getBookFilePath(lpath);
+    return submit(command);
+}
+
+std::future<bool> DbWriter::syncCollections(CollectionList collections) {
+    Command* command = new Command(CMD_SYNC_COLLECTIONS);
+    command->collections.swap(collections);
+    return submit(command);
+}
+
+std::future<bool> DbWriter::beginIngestBatch(int maxBooks, int maxSeconds) {
+    Command* command = new Command(CMD_BEGIN_BATCH);
+    command->maxBooks = maxBooks;
+    command->maxSeconds = maxSeconds;
+    return submit(command);
+}
+
+std::future<bool> DbWriter::endIngestBatch() {
+    return submit(new Command(CMD_END_BATCH));
+}
+
+std::future<bool> DbWriter::flushIngestGroup() {
+    return submit(new Command(CMD_FLUSH_GROUP));
+}
+
+std::future<bool> DbWriter::checkpoint() {
+    return submit(new Command(CMD_CHECKPOINT));
+}
@@ -0,0 +1,104 @@
+#ifndef DB_WRITER_H
+#define DB_WRITER_H
+
+#include "book_manager.h"
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+
+// Owns every explorer-3.db write. Commands are queued by the protocol
+// thread and run in order on a dedicated thread, so a lock held by the
+// PocketBook library service stalls this thread instead of socket reads.
+//
+// The queue is bounded: when it is full, submitting blocks until the
+// writer catches up. Each command returns a future for callers that need
+// the result; the others may simply drop it. A book write that lands in an
+// ingest group resolves when the group closes, false if it was not kept.
+class DbWriter {
+public:
+    static const size_t DEFAULT_CAPACITY = 64;
+
+    explicit DbWriter(BookManager* bookManager, size_t capacity = DEFAULT_CAPACITY);
+    ~DbWriter();
+
+    void start();
+
+    // Runs everything still queued, closes the writer connection and joins
+    void stop();
+
+    // Lpaths are resolved against the current storage when queued, so a
+    // later storage switch does not change where a pending write lands
+    std::future<bool> addBook(const BookMetadata& metadata);
+    std::future<bool> updateBookSync(const BookMetadata& metadata);
+    std::future<bool> deleteBook(const std::string& lpath);
+    std::future<bool> syncCollections(CollectionList collections);
+
+    std::future<bool> beginIngestBatch(int maxBooks, int maxSeconds);
+    std::future<bool> endIngestBatch();
+    std::future<bool> flushIngestGroup();
+    std::future<bool> checkpoint();
+
+    // Blocks until every command queued so far has run
+    void drain();
+
+private:
+    enum CommandType {
+        CMD_ADD_BOOK,
+        CMD_UPDATE_SYNC,
+        CMD_DELETE_BOOK,
+        CMD_SYNC_COLLECTIONS,
+        CMD_BEGIN_BATCH,
+        CMD_END_BATCH,
+        CMD_FLUSH_GROUP,
+        CMD_CHECKPOINT
+    };
+
+    struct Command {
+        CommandType type;
+        BookMetadata metadata;
+        std::string lpath;
+        CollectionList collections;
+        int maxBooks;
+        int maxSeconds;
+        std::promise<bool> result;
+
+        explicit Command(CommandType t) : type(t), maxBooks(0), maxSeconds(0) {}
+    };
+
+    BookManager* bookManager;
+    size_t capacity;
+
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::condition_variable idle;
+    std::deque<std::unique_ptr<Command> > queue;
+    std::thread worker;
+
+    // Writer thread only: succeeded writes waiting for their group's commit
+    std::vector<std::unique_ptr<Command> > held;
+    bool running;
+    bool stopping;
+    bool busy;
+
+    // Stats, logged on stop
+    long long executed;
+    long long producerWaitMs;
+    size_t highWater;
+
+    std::future<bool> submit(Command* command);
+    bool execute(Command& command);
+    void settle(std::unique_ptr<Command> command, bool ok);
+    void releaseHeld();
+    void run();
+
+    DbWriter(const DbWriter&);
+    DbWriter& operator=(const DbWriter&);
+};
+
+#endif // DB_WRITER_H
@@ -29,7 +29,8 @@ static const char* translations[][STR_COUNT] = {
         "Could not connect to WiFi network",   // STR_WIFI_CONNECT_FAILED
         "Total received",                  // STR_TOTAL_RECEIVED
         "Off",                             // STR_OFF
-        "On"                               // STR_ON
+        "On",                              // STR_ON
+        "Covers"                           // STR_COVERS
     },
     // Russian
     {
@@ -56,7 +57,8 @@ static const char* translations[][STR_COUNT] = {
         "Не удалось подключиться к WiFi сети", // STR_WIFI_CONNECT_FAILED
         "Всего получено",                  // STR_TOTAL_RECEIVED
         "Выкл",                            // STR_OFF
-        "Вкл"                              // STR_ON
+        "Вкл",                             // STR_ON
+        "Обложки"                          // STR_COVERS
     },
     // Ukrainian
     {
@@ -83,7 +85,8 @@ static const char* translations[][STR_COUNT] = {
         "Не вдалося підключитися до WiFi мережі", // STR_WIFI_CONNECT_FAILED
         "Всього отримано",                 // STR_TOTAL_RECEIVED
         "Вимк",                            // STR_OFF
-        "Увімкн"                           // STR_ON
+        "Увімкн",                          // STR_ON
+        "Обкладинки"                       // STR_COVERS
     },
     // Spanish
     {
@@ -110,7 +113,8 @@ static const char* translations[][STR_COUNT] = {
         "No se pudo conectar a la red WiFi",       // STR_WIFI_CONNECT_FAILED
         "Total recibido",                  // STR_TOTAL_RECEIVED
         "Apagado",                         // STR_OFF
-        "Encendido"                        // STR_ON
+        "Encendido",                       // STR_ON
+        "Portadas"                         // STR_COVERS
     }
 };
 
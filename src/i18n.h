@@ -39,6 +39,7 @@ typedef enum {
     STR_TOTAL_RECEIVED,
     STR_OFF,
     STR_ON,
+    STR_COVERS,
     STR_COUNT
 } StringId;
 
@@ -0,0 +1,95 @@
+#include "library_notifier.h"
+#include "logger.h"
+#include "inkview.h"
+
+LibraryNotifier::LibraryNotifier(bool dryRunOnly)
+    : dryRun(dryRunOnly), gated(false), flushRequested(false), configDirty(false), requested(0), totalRequested(0), totalSent(0) {
+}
+
+LibraryNotifier::~LibraryNotifier() {
+    flush();
+    if (totalRequested > 0) {
+        logMsg("Library notifications: %lld requested, %lld sent, %lld suppressed",
+               totalRequested, totalSent, totalRequested - totalSent);
+    }
+}
+
+void LibraryNotifier::bookReady(const std::string& filePath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    requested++;
+    if (pathSet.insert(filePath).second) {
+        paths.push_back(filePath);
+    }
+}
+
+void LibraryNotifier::configChanged() {
+    std::lock_guard<std::mutex> lock(mutex);
+    requested++;
+    configDirty = true;
+}
+
+bool LibraryNotifier::hasPending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return requested > 0;
+}
+
+void LibraryNotifier::setGated(bool on) {
+    std::lock_guard<std::mutex> lock(mutex);
+    gated = on;
+}
+
+bool LibraryNotifier::takeFlushRequest() {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool taken = flushRequested;
+    flushRequested = false;
+    return taken;
+}
+
+void LibraryNotifier::flush() {
+    send(false);
+}
+
+void LibraryNotifier::requestFlush() {
+    send(true);
+}
+
+void LibraryNotifier::send(bool deferIfGated) {
+    std::vector<std::string> sending;
+    bool sendConfig;
+    int folded;
+    {
+        // The gate is checked under the same lock as the swap, so nothing
+        // queued after a session gated the notifier is sent here
+        std::lock_guard<std::mutex> lock(mutex);
+        if (deferIfGated && gated) {
+            flushRequested = true;
+            return;
+        }
+        flushRequested = false;
+        if (requested == 0) return;
+
+        sending.swap(paths);
+        pathSet.clear();
+        sendConfig = configDirty;
+        configDirty = false;
+        folded = requested;
+        requested = 0;
+    }
+
+    // Sent outside the lock: the cover worker may be queueing more
+    for (size_t i = 0; i < sending.size() && !dryRun; i++) {
+        BookReady(sending[i].c_str());
+    }
+    if (sendConfig && !dryRun) {
+        NotifyConfigChanged();
+    }
+
+    int sent = (int)sending.size() + (sendConfig ? 1 : 0);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        totalRequested += folded;
+        totalSent += sent;
+    }
+    logMsg("Library notify: %d books ready%s, %d of %d notifications suppressed",
+           (int)sending.size(), sendConfig ? ", config changed" : "", folded - sent, folded);
+}
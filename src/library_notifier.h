@@ -0,0 +1,66 @@
+#ifndef LIBRARY_NOTIFIER_H
+#define LIBRARY_NOTIFIER_H
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+
+// Coalesces BookReady() and NotifyConfigChanged() calls. Each of them can
+// make the PocketBook library service re-read explorer-3.db, so during a
+// sync they are collected and sent once per batch boundary or quiet gap:
+// every changed path once, and a single config change.
+class LibraryNotifier {
+public:
+    // A dry-run notifier counts and logs but never calls InkView
+    explicit LibraryNotifier(bool dryRun = false);
+
+    // Sends whatever is still pending
+    ~LibraryNotifier();
+
+    // Safe to call from any thread
+    void bookReady(const std::string& filePath);
+    void configChanged();
+
+    bool hasPending() const;
+
+    // Sends the collected notifications and logs how many were folded
+    // into them
+    void flush();
+
+    // While gated, a session owns the database writes the notifications
+    // announce and decides when they are safe to send
+    void setGated(bool on);
+
+    // Safe to call from any thread. Flushes at once when not gated;
+    // otherwise leaves a request for takeFlushRequest().
+    void requestFlush();
+
+    // True once for each request left while gated
+    bool takeFlushRequest();
+
+private:
+    bool dryRun;
+
+    mutable std::mutex mutex;
+    bool gated;
+    bool flushRequested;
+    std::vector<std::string> paths; // In arrival order
+    std::unordered_set<std::string> pathSet;
+    bool configDirty;
+
+    // Since the last flush
+    int requested;
+
+    // Totals, logged on destruction
+    long long totalRequested;
+    long long totalSent;
+
+    // With `deferIfGated`, only records a request while gated
+    void send(bool deferIfGated);
+
+    LibraryNotifier(const LibraryNotifier&);
+    LibraryNotifier& operator=(const LibraryNotifier&);
+};
+
+#endif // LIBRARY_NOTIFIER_H
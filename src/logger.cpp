@@ -0,0 +1,228 @@
+#include "logger.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <ctime>
+#include <sys/stat.h>
+
+static const char* LOG_PATH = "/mnt/ext1/system/calibre-connect.log";
+
+// The log is started afresh at init once it reaches this size
+static const long MAX_LOG_SIZE = 256 * 1024;
+
+// Ring geometry: RING_SLOTS must be a power of two
+static const size_t RING_SLOTS = 512;
+static const size_t SLOT_TEXT = 232;
+
+// The writer wakes on this interval, or early once the ring is 3/4 full
+static const int WRITE_INTERVAL_MS = 500;
+
+// Bounded multi-producer queue after Dmitry Vyukov's design: a slot is
+// free for position p when its sequence is p and holds a line for p when
+// its sequence is p + 1. Producers claim positions with a CAS on
+// enqueuePos; the single consumer (under drainMutex) releases slots by
+// advancing their sequence a full lap.
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    time_t time;
+    int level;
+    const char* tag;
+    char text[SLOT_TEXT];
+};
+
+static LogSlot ring[RING_SLOTS];
+static std::atomic<size_t> enqueuePos(0);
+static std::atomic<size_t> dequeuePos(0);
+static std::atomic<unsigned> droppedLines(0);
+
+static std::atomic<bool> active(false);
+static std::atomic<int> runtimeLevel(LOG_INFO);
+
+// Serialises init/close
+static std::mutex lifecycleMutex;
+static bool ringReady = false;
+
+// Held by whoever drains the ring; guards logFile
+static std::mutex drainMutex;
+static FILE* logFile = NULL;
+
+static std::mutex wakeMutex;
+static std::condition_variable wake;
+static bool stopping = false;
+static std::thread writerThread;
+
+static const char* levelPrefix(int level) {
+    switch (level) {
+        case LOG_DEBUG: return "[DEBUG] ";
+        case LOG_ERROR: return "[ERROR] ";
+        default: return "";
+    }
+}
+
+// Caller holds drainMutex
+static void drain() {
+    int written = 0;
+    while (true) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        LogSlot& slot = ring[pos & (RING_SLOTS - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1) break;
+
+        if (logFile) {
+            struct tm tmInfo;
+            localtime_r(&slot.time, &tmInfo);
+            fprintf(logFile, "[%02d:%02d:%02d] %s", tmInfo.tm_hour, tmInfo.tm_min, tmInfo.tm_sec,
+                    levelPrefix(slot.level));
+            if (slot.tag) fprintf(logFile, "[%s] ", slot.tag);
+            fputs(slot.text, logFile);
+            fputc('\n', logFile);
+            written++;
+        }
+
+        slot.sequence.store(pos + RING_SLOTS, std::memory_order_release);
+        dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    }
+
+    unsigned dropped = droppedLines.exchange(0);
+    if (logFile && dropped > 0) {
+        fprintf(logFile, "[LOG] %u lines dropped, ring full\n", dropped);
+        written++;
+    }
+    if (logFile && written > 0) fflush(logFile);
+}
+
+static void writerLoop() {
+    std::unique_lock<std::mutex> lock(wakeMutex);
+    while (!stopping) {
+        wake.wait_for(lock, std::chrono::milliseconds(WRITE_INTERVAL_MS));
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> drainLock(drainMutex);
+            drain();
+        }
+        lock.lock();
+    }
+}
+
+void initLog() {
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    if (active) return;
+
+    if (!ringReady) {
+        for (size_t i = 0; i < RING_SLOTS; i++) {
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        ringReady = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> drainLock(drainMutex);
+
+        struct stat st;
+        if (stat(LOG_PATH, &st) == 0 && st.st_size >= MAX_LOG_SIZE) {
+            remove(LOG_PATH);
+        }
+
+        logFile = fopen(LOG_PATH, "a");
+        if (!logFile) return;
+
+        time_t now = time(NULL);
+        fprintf(logFile, "\n= Calibre Connect Started [%s] =\n", ctime(&now));
+        fflush(logFile);
+    }
+
+    {
+        std::lock_guard<std::mutex> wakeLock(wakeMutex);
+        stopping = false;
+    }
+    writerThread = std::thread(writerLoop);
+    active = true;
+}
+
+void closeLog() {
+    std::lock_guard<std::mutex> lock(lifecycleMutex);
+    if (!active) return;
+    active = false;
+
+    {
+        std::lock_guard<std::mutex> wakeLock(wakeMutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writerThread.join();
+
+    std::lock_guard<std::mutex> drainLock(drainMutex);
+    drain();
+    if (logFile) {
+        time_t now = time(NULL);
+        fprintf(logFile, "= Calibre Connect Closed [%s] =\n", ctime(&now));
+        fclose(logFile);
+        logFile = NULL;
+    }
+}
+
+void flushLog() {
+    if (!active) return;
+    std::lock_guard<std::mutex> drainLock(drainMutex);
+    drain();
+}
+
+void setLogLevel(int level) {
+    runtimeLevel = level;
+}
+
+bool logEnabled(int level) {
+    return active.load(std::memory_order_relaxed) &&
+           level >= runtimeLevel.load(std::memory_order_relaxed);
+}
+
+static void enqueue(int level, const char* tag, const char* format, va_list args) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    while (true) {
+        slot = &ring[pos & (RING_SLOTS - 1)];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // The writer has not caught up with a full lap
+            droppedLines++;
+            return;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->time = time(NULL);
+    slot->level = level;
+    slot->tag = tag;
+    vsnprintf(slot->text, SLOT_TEXT, format, args);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    if (pos + 1 - dequeuePos.load(std::memory_order_relaxed) >= RING_SLOTS * 3 / 4) {
+        wake.notify_one();
+    }
+}
+
+void logWrite(int level, const char* tag, const char* format, ...) {
+    if (!logEnabled(level)) return;
+
+    va_list args;
+    va_start(args, format);
+    enqueue(level, tag, format, args);
+    va_end(args);
+}
+
+void logMsg(const char* format, ...) {
+    if (LOG_INFO < LOG_MIN_LEVEL || !logEnabled(LOG_INFO)) return;
+
+    va_list args;
+    va_start(args, format);
+    enqueue(LOG_INFO, NULL, format, args);
+    va_end(args);
+}
@@ -0,0 +1,44 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Asynchronous logger for /mnt/ext1/system/calibre-connect.log.
+//
+// Any thread formats its line into a slot of a fixed-size ring without
+// taking a lock; a background thread writes the slots to the file, which
+// stays open while logging is enabled. When the ring is full, lines are
+// dropped and counted instead of blocking the caller.
+//
+// Levels are filtered twice: calls below LOG_MIN_LEVEL compile to nothing,
+// and the rest are checked against the run-time level.
+
+enum LogLevel { LOG_DEBUG = 0, LOG_INFO = 1, LOG_ERROR = 2 };
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+// Opens the log and starts the writer thread; logging is off until then
+void initLog();
+
+// Writes everything still buffered, then stops the thread and closes
+void closeLog();
+
+// Blocks until every line logged so far is in the file
+void flushLog();
+
+void setLogLevel(int level);
+bool logEnabled(int level);
+
+// `tag` may be NULL; lines longer than a slot are truncated
+void logWrite(int level, const char* tag, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Untagged INFO line
+void logMsg(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+#define LOG_AT(level, tag, ...) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL && logEnabled(level)) logWrite((level), (tag), __VA_ARGS__); \
+    } while (0)
+
+#endif // LOGGER_H
@@ -3,7 +3,11 @@
 #include "calibre_protocol.h"
 #include "book_manager.h"
 #include "cache_manager.h"
+#include "cover_queue.h"
+#include "library_notifier.h"
 #include "i18n.h"
+#include "logger.h"
+#include "timeline.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -25,72 +29,15 @@
 #define EVT_BOOK_RECEIVED 20004
 #define EVT_SHOW_TOAST 20005
 #define EVT_BATCH_COMPLETE 20006
+#define EVT_COVER_PROGRESS 20007
 
 // Toast types
 #define TOAST_CONNECTED 2
 #define TOAST_DISCONNECTED 3
 
-#define MAX_LOG_SIZE (256 * 1024)
-
-// --- Logging System (Thread Safe) ---
+// --- Logging ---
+// Mirrors the enable_logging setting; the logger itself lives in logger.cpp
 static std::atomic<bool> isLoggingEnabled(false);
-static FILE* logFile = NULL;
-static std::mutex logMutex; // Mutex for log file access
-
-void initLog() {
-    if (!isLoggingEnabled) return;
-
-    const char* logPath = "/mnt/ext1/system/calibre-connect.log";
-    
-    std::lock_guard<std::mutex> lock(logMutex);
-
-    if (logFile) return;
-
-    struct stat st;
-    if (stat(logPath, &st) == 0) {
-        if (st.st_size >= MAX_LOG_SIZE) {
-            remove(logPath); 
-        }
-    }
-
-    logFile = fopen(logPath, "a");
-    if (logFile) {
-        time_t now = time(NULL);
-        fprintf(logFile, "\n= Calibre Connect Started [%s] =\n", ctime(&now));
-        fflush(logFile);
-    }
-}
-
-void logMsg(const char* format, ...) {
-    if (!isLoggingEnabled) return;
-
-    std::lock_guard<std::mutex> lock(logMutex);
-    
-    if (!logFile) return;
-    
-    time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    fprintf(logFile, "[%02d:%02d:%02d] ", 
-            tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
-    
-    va_list args;
-    va_start(args, format);
-    vfprintf(logFile, format, args);
-    va_end(args);
-    fprintf(logFile, "\n");
-    fflush(logFile);
-}
-
-void closeLog() {
-    std::lock_guard<std::mutex> lock(logMutex);
-    if (logFile) {
-        time_t now = time(NULL);
-        fprintf(logFile, "= Calibre Connect Closed [%s] =\n", ctime(&now));
-        fflush(logFile);
-        fclose(logFile);
-        logFile = NULL;
-    }
-}
 
 // --- Global Config ---
 static iconfig *appConfig = NULL;
@@ -108,6 +55,22 @@ static const char *KEY_FAVORITE_COLUMN = "favorite_column";
 static const char *KEY_ENABLE_LOG = "enable_logging";
 static const char *DEFAULT_ENABLE_LOG = "0";
 
+// Hidden (not in the config editor): 0 debug, 1 info, 2 errors only.
+// Debug lines also need a build with LOG_MIN_LEVEL=0.
+static const char *KEY_LOG_LEVEL = "log_level";
+
+// Hidden (not in the config editor): per-statement SQL profile at disconnect
+static const char *KEY_SQL_PROFILING = "sql_profiling";
+
+// Hidden (not in the config editor): 0 off, 1 frame trace, 2 with JSON bodies
+// (needed by calibre-replay)
+static const char *KEY_SESSION_TRACE = "session_trace";
+static const char *SESSION_TRACE_PATH = "/mnt/ext1/system/calibre-connect-trace.bin";
+
+// Hidden (not in the config editor): Chrome trace-event timeline of each
+// session, written to calibre-connect-timeline.json at disconnect
+static const char *KEY_TIMELINE = "timeline";
+
 // Default values
 static const char *DEFAULT_IP = "192.168.1.100";
 static const char *DEFAULT_PORT = "9090";
@@ -128,6 +91,8 @@ static char connectionErrorBuffer[256] = "";
 static std::unique_ptr<NetworkManager> networkManager;
 static std::unique_ptr<BookManager> bookManager;
 static std::unique_ptr<CacheManager> cacheManager;
+static std::unique_ptr<LibraryNotifier> libraryNotifier;
+static std::unique_ptr<CoverQueue> coverQueue;
 static std::unique_ptr<CalibreProtocol> protocol;
 
 static std::thread connectionThread;
@@ -219,6 +184,14 @@ void notifyConnectionFailed(const char* errorMsg) {
     SendEvent(mainEventHandler, EVT_CONNECTION_FAILED, 0, 0);
 }
 
+// Only the connection thread ends a session, so the protocol's teardown
+// never runs on two threads at once
+static void endSession() {
+    protocol->disconnect();
+    networkManager->disconnect();
+    networkManager->stopTrace();
+}
+
 // Thread function - accepts config by value to avoid race conditions
 void connectionThreadFunc(ConnectionConfig config) {
     logMsg("Connecting to %s:%d", config.ip.c_str(), config.port);
@@ -226,12 +199,14 @@ void connectionThreadFunc(ConnectionConfig config) {
     booksReceivedCount = 0;
     
     if (shouldStop) {
+        endSession();
         isConnecting = false;
         return;
     }
     
     // Use the smart pointers initialized in startCalibreConnection
     if (!networkManager->connectToServer(config.ip, config.port)) {
+        endSession();
         isConnecting = false;
         
         char errorMsg[512];
@@ -243,14 +218,14 @@ void connectionThreadFunc(ConnectionConfig config) {
     }
     
     if (shouldStop) {
-        networkManager->disconnect();
+        endSession();
         isConnecting = false;
         return;
     }
     
     if (!protocol->performHandshake(config.password)) {
         logMsg("Handshake failed: %s", protocol->getErrorMessage().c_str());
-        networkManager->disconnect();
+        endSession();
         isConnecting = false;
         
         char errorMsg[512];
@@ -278,9 +253,7 @@ void connectionThreadFunc(ConnectionConfig config) {
 		});
     
     logMsg("Disconnecting");
-    
-    if (protocol) protocol->disconnect();
-    if (networkManager) networkManager->disconnect();
+    endSession();
     
     isConnecting = false;
     SendEvent(mainEventHandler, EVT_SHOW_TOAST, TOAST_DISCONNECTED, 0);
@@ -336,20 +309,34 @@ void startCalibreConnection() {
     const char* readDateCol = ReadString(appConfig, KEY_READ_DATE_COLUMN, DEFAULT_READ_DATE_COLUMN);
     const char* favCol = ReadString(appConfig, KEY_FAVORITE_COLUMN, DEFAULT_FAVORITE_COLUMN);
     
+    // The previous session's thread is done with the protocol once joined
+    if (connectionThread.joinable()) {
+        connectionThread.join();
+    }
+    
+    // Diagnostics; after the join, since ending a session stops its trace
+    bookManager->enableSqlProfiling(ReadInt(appConfig, KEY_SQL_PROFILING, 0) != 0);
+    Timeline::instance().setEnabled(ReadInt(appConfig, KEY_TIMELINE, 0) != 0);
+    
+    int traceLevel = ReadInt(appConfig, KEY_SESSION_TRACE, 0);
+    if (traceLevel > 0) {
+        networkManager->startTrace(SESSION_TRACE_PATH, traceLevel >= 2);
+    } else {
+        networkManager->stopTrace();
+    }
+    
     protocol.reset(new CalibreProtocol(
         networkManager.get(), 
         bookManager.get(), 
         cacheManager.get(),
+        coverQueue.get(),
+        libraryNotifier.get(),
         readCol ? readCol : "", 
         readDateCol ? readDateCol : "", 
         favCol ? favCol : ""
     ));
     
     // --- 3. Start Thread ---
-    if (connectionThread.joinable()) {
-        connectionThread.join();
-    }
-    
     try {
         connectionThread = std::thread(connectionThreadFunc, config);
     } catch (const std::system_error& e) {
@@ -382,12 +369,37 @@ void connectionTimerFunc() {
     startConnection();
 }
 
+// Starts reading the metadata cache for the last known device UUID while
+// WiFi and the Calibre handshake are still in progress
+void preloadCache() {
+    if (!cacheManager) {
+        cacheManager.reset(new CacheManager());
+    }
+    
+    const char* uuid = ReadString(GetGlobalConfig(), "calibre_device_uuid", "");
+    if (uuid && uuid[0]) {
+        cacheManager->initializeAsync(uuid);
+    }
+}
+
+// Resumes covers left unfinished by the last run; progress is reported
+// as "finished/queued" until the queue drains
+void startCoverQueue() {
+    if (coverQueue) return;
+    
+    libraryNotifier.reset(new LibraryNotifier());
+    coverQueue.reset(new CoverQueue(libraryNotifier.get()));
+    coverQueue->start([](const CoverQueue::Progress& progress) {
+        SendEvent(mainEventHandler, EVT_COVER_PROGRESS,
+                  progress.done + progress.failed, progress.queued);
+    });
+}
+
 void stopConnection() {
     shouldStop = true;
     
-    // Trigger disconnect to break blocking socket calls
-    if (protocol) protocol->disconnect();
-    if (networkManager) networkManager->disconnect();
+    // Wakes the connection thread, which ends the session itself
+    if (networkManager) networkManager->interrupt();
 
     // Wait for thread to finish if it's running
     if (connectionThread.joinable()) {
@@ -418,6 +430,7 @@ void initConfig() {
 	if (appConfig) {
         int logState = ReadInt(appConfig, KEY_ENABLE_LOG, atoi(DEFAULT_ENABLE_LOG));
         isLoggingEnabled = (logState != 0);
+        setLogLevel(ReadInt(appConfig, KEY_LOG_LEVEL, LOG_INFO));
         
         if (isLoggingEnabled) {
             initLog();
@@ -498,6 +511,8 @@ void performExit() {
     
     // 4. Release Resources (RAII handles deletion)
     protocol.reset();
+    coverQueue.reset();
+    libraryNotifier.reset();
     cacheManager.reset();
     networkManager.reset();
     bookManager.reset();
@@ -528,6 +543,8 @@ int mainEventHandler(int type, int par1, int par2) {
             
             showMainScreen();
             SoftUpdate();
+            preloadCache();
+            startCoverQueue();
             SetWeakTimer("ConnectTimer", (iv_timerproc)connectionTimerFunc, 300);
             break;
             
@@ -586,6 +603,14 @@ int mainEventHandler(int type, int par1, int par2) {
             break;
         }
 
+        case EVT_COVER_PROGRESS: {
+            char statusBuffer[128];
+            snprintf(statusBuffer, sizeof(statusBuffer), "%s (%d/%d)",
+                     i18n_get(STR_COVERS), par1, par2);
+            updateConnectionStatus(statusBuffer);
+            break;
+        }
+
         case EVT_SHOW_TOAST:
             if (par1 == TOAST_CONNECTED) {
                 Message(ICON_INFORMATION, "Calibre", i18n_get(STR_CONNECTED), 2000);
@@ -0,0 +1,121 @@
+#include "maintenance.h"
+#include "logger.h"
+#include <chrono>
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MaintenanceScheduler::MaintenanceScheduler() : lastRequestMs(monotonicMs()) {
+}
+
+int MaintenanceScheduler::addTask(const std::string& name, int minIdleMs, int maxStaleMs, Task task) {
+    Entry entry;
+    entry.name = name;
+    entry.minIdleMs = minIdleMs;
+    entry.maxStaleMs = maxStaleMs;
+    entry.task = task;
+    entry.dirty = false;
+    entry.dirtySince = 0;
+    entry.runs = 0;
+    entry.totalMs = 0;
+    tasks.push_back(entry);
+    return (int)tasks.size() - 1;
+}
+
+bool MaintenanceScheduler::onOwnerThread(const char* caller) {
+    std::thread::id self = std::this_thread::get_id();
+    if (owner == std::thread::id()) owner = self;
+    if (owner == self) return true;
+
+    LOG_AT(LOG_ERROR, NULL, "Maintenance: %s called off the connection thread, ignored", caller);
+    return false;
+}
+
+void MaintenanceScheduler::markDirty(int taskId) {
+    if (!onOwnerThread("markDirty")) return;
+    if (taskId < 0 || taskId >= (int)tasks.size()) return;
+
+    Entry& entry = tasks[taskId];
+    if (!entry.dirty) {
+        entry.dirty = true;
+        entry.dirtySince = monotonicMs();
+    }
+}
+
+void MaintenanceScheduler::noteRequest(bool keepalive) {
+    if (!onOwnerThread("noteRequest")) return;
+    if (!keepalive) {
+        lastRequestMs = monotonicMs();
+    }
+}
+
+int MaintenanceScheduler::nextIdleDelayMs() const {
+    long long idleMs = monotonicMs() - lastRequestMs;
+    long long best = -1;
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (!tasks[i].dirty) continue;
+
+        long long wait = tasks[i].minIdleMs - idleMs;
+        if (wait < 0) wait = 0;
+        if (best < 0 || wait < best) best = wait;
+    }
+    return (int)best;
+}
+
+void MaintenanceScheduler::run(Entry& entry, const char* reason) {
+    entry.dirty = false;
+
+    long long start = monotonicMs();
+    entry.task();
+    long long elapsed = monotonicMs() - start;
+
+    entry.runs++;
+    entry.totalMs += elapsed;
+    logMsg("Maintenance: %s (%s) took %lld ms", entry.name.c_str(), reason, elapsed);
+}
+
+bool MaintenanceScheduler::runIdle() {
+    if (!onOwnerThread("runIdle")) return false;
+    long long now = monotonicMs();
+    long long idleMs = now - lastRequestMs;
+    Entry* stalest = nullptr;
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        Entry& entry = tasks[i];
+        if (!entry.dirty || idleMs < entry.minIdleMs) continue;
+        if (!stalest || entry.dirtySince < stalest->dirtySince) {
+            stalest = &entry;
+        }
+    }
+
+    // One task per call, so a request arriving mid-gap waits for at most one
+    if (stalest) {
+        run(*stalest, "idle");
+        return true;
+    }
+    return false;
+}
+
+void MaintenanceScheduler::runOverdue() {
+    if (!onOwnerThread("runOverdue")) return;
+    long long now = monotonicMs();
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        Entry& entry = tasks[i];
+        if (entry.dirty && now - entry.dirtySince >= entry.maxStaleMs) {
+            run(entry, "overdue");
+        }
+    }
+}
+
+void MaintenanceScheduler::runPending() {
+    if (!onOwnerThread("runPending")) return;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i].dirty) {
+            run(tasks[i], "flush");
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+
+// Runs deferred housekeeping (WAL checkpoints, cache saves, log flushes)
+// in the gaps between Calibre requests instead of inside the handlers.
+//
+// A task only runs after it has been marked dirty. It normally waits until
+// the protocol has been quiet for `minIdleMs`; once it has been dirty for
+// `maxStaleMs` it runs at the next opcode boundary even without a gap.
+//
+// Not thread-safe. Tasks are added by the constructing thread; every other
+// call must come from one thread, the first to make one (the connection
+// thread). Calls from any other thread are logged and ignored.
+class MaintenanceScheduler {
+public:
+    typedef std::function<void()> Task;
+
+    MaintenanceScheduler();
+
+    // Returns the task id used by markDirty()
+    int addTask(const std::string& name, int minIdleMs, int maxStaleMs, Task task);
+
+    void markDirty(int taskId);
+
+    // Called for every received opcode. Keepalive NOOPs do not end an
+    // idle gap, so they do not reset the idle timer.
+    void noteRequest(bool keepalive);
+
+    // Milliseconds until the next dirty task becomes eligible to run in an
+    // idle gap, 0 if one is eligible now, -1 if nothing is pending
+    int nextIdleDelayMs() const;
+
+    // Runs the stalest task whose idle threshold has passed.
+    // Returns true if a task ran.
+    bool runIdle();
+
+    // Runs every task that has exceeded its staleness bound
+    void runOverdue();
+
+    // Runs every dirty task (used at disconnect)
+    void runPending();
+
+private:
+    struct Entry {
+        std::string name;
+        int minIdleMs;
+        int maxStaleMs;
+        Task task;
+        bool dirty;
+        long long dirtySince;
+        int runs;
+        long long totalMs;
+    };
+
+    std::vector<Entry> tasks;
+    long long lastRequestMs;
+    std::thread::id owner;
+
+    bool onOwnerThread(const char* caller);
+
+    void run(Entry& entry, const char* reason);
+};
+
+#endif // MAINTENANCE_H
@@ -0,0 +1,212 @@
+#include "metrics.h"
+#include "network.h"
+#include "logger.h"
+#include <json-c/json.h>
+#include <cstdio>
+
+const int MetricsRegistry::BUCKET_LIMITS_MS[MetricsRegistry::BUCKET_COUNT - 1] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static const char* PHASE_NAMES[MetricsRegistry::PHASE_COUNT] = {
+    "wait", "receive", "parse", "handle", "maintenance", "network_io", "sqlite", "cover"
+};
+
+const char* MetricsRegistry::phaseName(int phase) {
+    return (phase >= 0 && phase < PHASE_COUNT) ? PHASE_NAMES[phase] : "unknown";
+}
+
+const char* MetricsRegistry::opcodeName(int opcode) {
+    switch (opcode) {
+        case OK: return "OK";
+        case SET_CALIBRE_DEVICE_INFO: return "SET_CALIBRE_DEVICE_INFO";
+        case SET_CALIBRE_DEVICE_NAME: return "SET_CALIBRE_DEVICE_NAME";
+        case GET_DEVICE_INFORMATION: return "GET_DEVICE_INFORMATION";
+        case TOTAL_SPACE: return "TOTAL_SPACE";
+        case FREE_SPACE: return "FREE_SPACE";
+        case GET_BOOK_COUNT: return "GET_BOOK_COUNT";
+        case SEND_BOOKLISTS: return "SEND_BOOKLISTS";
+        case SEND_BOOK: return "SEND_BOOK";
+        case GET_INITIALIZATION_INFO: return "GET_INITIALIZATION_INFO";
+        case BOOK_DONE: return "BOOK_DONE";
+        case NOOP: return "NOOP";
+        case DELETE_BOOK: return "DELETE_BOOK";
+        case GET_BOOK_FILE_SEGMENT: return "GET_BOOK_FILE_SEGMENT";
+        case GET_BOOK_METADATA: return "GET_BOOK_METADATA";
+        case SEND_BOOK_METADATA: return "SEND_BOOK_METADATA";
+        case DISPLAY_MESSAGE: return "DISPLAY_MESSAGE";
+        case CALIBRE_BUSY: return "CALIBRE_BUSY";
+        case SET_LIBRARY_INFO: return "SET_LIBRARY_INFO";
+        case ERROR_OPCODE: return "ERROR";
+        case CARD_PREFIX: return "CARD_PREFIX";
+        default: return "UNKNOWN";
+    }
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::MetricsRegistry() {
+    reset();
+}
+
+void MetricsRegistry::reset() {
+    for (int i = 0; i <= MAX_OPCODE; i++) {
+        Histogram& h = opcodes[i].latency;
+        for (int b = 0; b < BUCKET_COUNT; b++) h.buckets[b] = 0;
+        h.count = 0;
+        h.totalMicros = 0;
+        h.maxMicros = 0;
+        opcodes[i].bytesIn = 0;
+        opcodes[i].bytesOut = 0;
+    }
+    for (int p = 0; p < PHASE_COUNT; p++) phaseMicros[p] = 0;
+    bytesIn = 0;
+    bytesOut = 0;
+    currentOpcode = -1;
+    sessionStartMicros = nowMicros();
+}
+
+int MetricsRegistry::slotFor(int opcode) const {
+    return (opcode >= 0 && opcode < MAX_OPCODE) ? opcode : MAX_OPCODE;
+}
+
+void MetricsRegistry::beginRequest(int opcode, size_t frameBytes) {
+    currentOpcode = opcode;
+    opcodes[slotFor(opcode)].bytesIn += (long long)frameBytes;
+}
+
+void MetricsRegistry::endRequest(long long micros) {
+    int opcode = currentOpcode.exchange(-1);
+    if (opcode < 0) return;
+
+    Histogram& h = opcodes[slotFor(opcode)].latency;
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && micros > BUCKET_LIMITS_MS[bucket] * 1000LL) bucket++;
+    h.buckets[bucket]++;
+    h.count++;
+    h.totalMicros += micros;
+
+    long long seen = h.maxMicros.load();
+    while (micros > seen && !h.maxMicros.compare_exchange_weak(seen, micros)) {}
+}
+
+void MetricsRegistry::addBytes(Direction direction, size_t bytes) {
+    int opcode = currentOpcode.load(std::memory_order_relaxed);
+    if (direction == DIR_IN) {
+        bytesIn += (long long)bytes;
+        if (opcode >= 0) opcodes[slotFor(opcode)].bytesIn += (long long)bytes;
+    } else {
+        bytesOut += (long long)bytes;
+        if (opcode >= 0) opcodes[slotFor(opcode)].bytesOut += (long long)bytes;
+    }
+}
+
+void MetricsRegistry::addPhaseTime(Phase phase, long long micros) {
+    phaseMicros[phase] += micros;
+}
+
+std::string MetricsRegistry::toJson() const {
+    json_object* root = json_object_new_object();
+    json_object_object_add(root, "session_ms",
+                           json_object_new_int64((nowMicros() - sessionStartMicros) / 1000));
+    json_object_object_add(root, "bytes_in", json_object_new_int64(bytesIn));
+    json_object_object_add(root, "bytes_out", json_object_new_int64(bytesOut));
+
+    json_object* phases = json_object_new_object();
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        json_object_object_add(phases, PHASE_NAMES[p], json_object_new_int64(phaseMicros[p] / 1000));
+    }
+    json_object_object_add(root, "phase_ms", phases);
+
+    json_object* limits = json_object_new_array();
+    for (int b = 0; b < BUCKET_COUNT - 1; b++) {
+        json_object_array_add(limits, json_object_new_int(BUCKET_LIMITS_MS[b]));
+    }
+    json_object_object_add(root, "bucket_limits_ms", limits);
+
+    json_object* ops = json_object_new_object();
+    for (int i = 0; i <= MAX_OPCODE; i++) {
+        const OpcodeStats& stats = opcodes[i];
+        unsigned count = stats.latency.count;
+        if (count == 0 && stats.bytesIn == 0 && stats.bytesOut == 0) continue;
+
+        json_object* op = json_object_new_object();
+        long long totalMicros = stats.latency.totalMicros;
+        json_object_object_add(op, "count", json_object_new_int((int)count));
+        json_object_object_add(op, "total_ms", json_object_new_int64(totalMicros / 1000));
+        json_object_object_add(op, "max_ms", json_object_new_int64(stats.latency.maxMicros / 1000));
+
+        json_object* buckets = json_object_new_array();
+        for (int b = 0; b < BUCKET_COUNT; b++) {
+            json_object_array_add(buckets, json_object_new_int((int)stats.latency.buckets[b]));
+        }
+        json_object_object_add(op, "buckets", buckets);
+
+        json_object_object_add(op, "bytes_in", json_object_new_int64(stats.bytesIn));
+        json_object_object_add(op, "bytes_out", json_object_new_int64(stats.bytesOut));
+        if (totalMicros > 0) {
+            json_object_object_add(op, "in_bytes_per_sec",
+                                   json_object_new_int64(stats.bytesIn * 1000000LL / totalMicros));
+        }
+        json_object_object_add(ops, i < MAX_OPCODE ? opcodeName(i) : "UNKNOWN", op);
+    }
+    json_object_object_add(root, "opcodes", ops);
+
+    std::string out = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+    json_object_put(root);
+    return out;
+}
+
+bool MetricsRegistry::writeJson(const std::string& path) const {
+    std::string json = toJson();
+    std::string tmpPath = path + ".tmp";
+
+    FILE* f = fopen(tmpPath.c_str(), "w");
+    if (!f) return false;
+    bool ok = fwrite(json.data(), 1, json.size(), f) == json.size();
+    ok = (fclose(f) == 0) && ok;
+
+    // Readers never see a half-written file
+    return ok && rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+void MetricsRegistry::logSummary() const {
+    logMsg("Metrics: %lld ms session, %lld bytes in, %lld bytes out",
+           (nowMicros() - sessionStartMicros) / 1000, (long long)bytesIn, (long long)bytesOut);
+    logMsg("Metrics phases (ms): wait %lld, receive %lld, parse %lld, handle %lld, maintenance %lld, "
+           "network %lld, sqlite %lld, cover %lld",
+           phaseMicros[PHASE_WAIT] / 1000, phaseMicros[PHASE_RECEIVE] / 1000,
+           phaseMicros[PHASE_PARSE] / 1000, phaseMicros[PHASE_HANDLE] / 1000,
+           phaseMicros[PHASE_MAINTENANCE] / 1000, phaseMicros[PHASE_NETWORK_IO] / 1000,
+           phaseMicros[PHASE_SQLITE] / 1000, phaseMicros[PHASE_COVER] / 1000);
+
+    for (int i = 0; i <= MAX_OPCODE; i++) {
+        const OpcodeStats& stats = opcodes[i];
+        unsigned count = stats.latency.count;
+        if (count == 0) continue;
+
+        // Median as the upper bound of the bucket holding it
+        unsigned seen = 0;
+        int median = BUCKET_COUNT - 1;
+        for (int b = 0; b < BUCKET_COUNT; b++) {
+            seen += stats.latency.buckets[b];
+            if (seen * 2 >= count) { median = b; break; }
+        }
+        char medianText[16];
+        if (median < BUCKET_COUNT - 1) {
+            snprintf(medianText, sizeof(medianText), "<=%d", BUCKET_LIMITS_MS[median]);
+        } else {
+            snprintf(medianText, sizeof(medianText), ">%d", BUCKET_LIMITS_MS[BUCKET_COUNT - 2]);
+        }
+
+        long long totalMicros = stats.latency.totalMicros;
+        logMsg("Metrics %s: %u calls, p50 %s ms, max %lld ms, total %lld ms, in %lld B (%lld B/s), out %lld B",
+               i < MAX_OPCODE ? opcodeName(i) : "UNKNOWN", count, medianText,
+               stats.latency.maxMicros / 1000, totalMicros / 1000, (long long)stats.bytesIn,
+               totalMicros > 0 ? stats.bytesIn * 1000000LL / totalMicros : 0LL,
+               (long long)stats.bytesOut);
+    }
+}
@@ -0,0 +1,115 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "alloc_tracker.h"
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+// Session metrics: per-opcode latency histograms, bytes per direction and
+// time per phase. Every counter is atomic, so the protocol, DB writer and
+// cover threads record without locks, and a snapshot can be taken at any
+// point of a session.
+class MetricsRegistry {
+public:
+    // WAIT..MAINTENANCE split the protocol thread's loop in handleMessages;
+    // the others add up time spent in that kind of work on any thread
+    enum Phase {
+        PHASE_WAIT,         // Blocked on the socket for the next request
+        PHASE_RECEIVE,      // Reading the request frame
+        PHASE_PARSE,        // Parsing its JSON
+        PHASE_HANDLE,       // Running the opcode handler
+        PHASE_MAINTENANCE,  // Idle tasks, write reaping
+        PHASE_NETWORK_IO,   // Socket send/recv calls
+        PHASE_SQLITE,       // DB writer commands
+        PHASE_COVER,        // Cover rendering
+        PHASE_COUNT
+    };
+
+    enum Direction { DIR_IN, DIR_OUT };
+
+    // Upper bounds in ms; a last bucket catches everything slower
+    static const int BUCKET_COUNT = 14;
+    static const int BUCKET_LIMITS_MS[BUCKET_COUNT - 1];
+
+    // Opcodes at or above this are counted as unknown
+    static const int MAX_OPCODE = 64;
+
+    static MetricsRegistry& instance();
+
+    static const char* opcodeName(int opcode);
+    static const char* phaseName(int phase);
+
+    void reset();
+
+    // Frames the handling of one request. Bytes moved in between are
+    // attributed to `opcode`, starting with the request frame itself.
+    void beginRequest(int opcode, size_t frameBytes);
+    void endRequest(long long micros);
+
+    void addBytes(Direction direction, size_t bytes);
+    void addPhaseTime(Phase phase, long long micros);
+
+    std::string toJson() const;
+    bool writeJson(const std::string& path) const;
+
+    // One line per opcode seen, for the disconnect log
+    void logSummary() const;
+
+    static long long nowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct Histogram {
+        std::atomic<unsigned> buckets[BUCKET_COUNT];
+        std::atomic<unsigned> count;
+        std::atomic<long long> totalMicros;
+        std::atomic<long long> maxMicros;
+    };
+
+    struct OpcodeStats {
+        Histogram latency;
+        std::atomic<long long> bytesIn;
+        std::atomic<long long> bytesOut;
+    };
+
+    OpcodeStats opcodes[MAX_OPCODE + 1]; // Last slot: unknown opcodes
+    std::atomic<long long> bytesIn;
+    std::atomic<long long> bytesOut;
+    std::atomic<long long> phaseMicros[PHASE_COUNT];
+    std::atomic<int> currentOpcode;
+    std::atomic<long long> sessionStartMicros;
+
+    MetricsRegistry();
+
+    int slotFor(int opcode) const;
+
+    MetricsRegistry(const MetricsRegistry&);
+    MetricsRegistry& operator=(const MetricsRegistry&);
+};
+
+// Adds the lifetime of the scope to a phase; allocations made in it are
+// counted against the phase too
+class PhaseTimer {
+public:
+    explicit PhaseTimer(MetricsRegistry::Phase phase)
+        : phase(phase), start(MetricsRegistry::nowMicros()),
+          outerAllocPhase(AllocTracker::setPhase(phase)) {}
+    ~PhaseTimer() {
+        MetricsRegistry::instance().addPhaseTime(phase, MetricsRegistry::nowMicros() - start);
+        AllocTracker::setPhase(outerAllocPhase);
+    }
+
+private:
+    MetricsRegistry::Phase phase;
+    long long start;
+    int outerAllocPhase;
+
+    PhaseTimer(const PhaseTimer&);
+    PhaseTimer& operator=(const PhaseTimer&);
+};
+
+#endif // METRICS_H
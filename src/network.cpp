@@ -1,4 +1,7 @@
 #include "network.h"
+#include "logger.h"
+#include "metrics.h"
+#include "session_trace.h"
 #include <cstring>
 #include <fcntl.h>
 #include <errno.h>
@@ -10,9 +13,6 @@
 #include <vector>
 #include <algorithm>
 
-// Use the thread-safe logger from main.cpp
-extern void logMsg(const char* format, ...);
-
 // RAII Wrapper for socket file descriptors to ensure they are closed
 class SocketGuard {
     int& fd_;
@@ -264,9 +264,8 @@ bool NetworkManager::connectToServer(const std::string& host, int port) {
         return false;
     }
     
-    // Set 5 minute timeout
     struct timeval timeout;
-    timeout.tv_sec = 300;
+    timeout.tv_sec = RECEIVE_TIMEOUT_MS / 1000;
     timeout.tv_usec = 0;
     setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
@@ -276,14 +275,22 @@ bool NetworkManager::connectToServer(const std::string& host, int port) {
 
 void NetworkManager::disconnect() {
     if (socketFd >= 0) {
+        // close() alone does not wake a select() or recv() on another thread
+        shutdown(socketFd, SHUT_RDWR);
         close(socketFd);
         socketFd = -1;
     }
 }
 
+void NetworkManager::interrupt() {
+    int fd = socketFd;
+    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
 bool NetworkManager::sendAll(const void* data, size_t length) {
     const char* ptr = static_cast<const char*>(data);
     size_t remaining = length;
+    PhaseTimer timer(MetricsRegistry::PHASE_NETWORK_IO);
     
     while (remaining > 0) {
         ssize_t sent = send(socketFd, ptr, remaining, 0);
@@ -295,12 +302,14 @@ bool NetworkManager::sendAll(const void* data, size_t length) {
         ptr += sent;
         remaining -= sent;
     }
+    MetricsRegistry::instance().addBytes(MetricsRegistry::DIR_OUT, length);
     return true;
 }
 
 bool NetworkManager::receiveAll(void* buffer, size_t length) {
     char* ptr = static_cast<char*>(buffer);
     size_t remaining = length;
+    PhaseTimer timer(MetricsRegistry::PHASE_NETWORK_IO);
     
     while (remaining > 0) {
         ssize_t received = recv(socketFd, ptr, remaining, 0);
@@ -312,6 +321,7 @@ bool NetworkManager::receiveAll(void* buffer, size_t length) {
         ptr += received;
         remaining -= received;
     }
+    MetricsRegistry::instance().addBytes(MetricsRegistry::DIR_IN, length);
     return true;
 }
 
@@ -372,7 +382,12 @@ bool NetworkManager::sendJSON(CalibreOpcode opcode, const char* jsonData) {
     std::string message = "[" + std::to_string((int)opcode) + "," + jsonData + "]";
     std::string packet = std::to_string(message.length()) + message;
     
-    return sendAll(packet.c_str(), packet.length());
+    if (!sendAll(packet.c_str(), packet.length())) return false;
+    if (trace) {
+        trace->record(SessionTraceRecord::OUT, SessionTraceRecord::JSON, (int)opcode,
+                      (uint32_t)packet.length(), message.data(), message.length());
+    }
+    return true;
 }
 
 bool NetworkManager::receiveJSON(CalibreOpcode& opcode, std::string& jsonData) {
@@ -404,15 +419,47 @@ bool NetworkManager::receiveJSON(CalibreOpcode& opcode, std::string& jsonData) {
     int opcodeValue = atoi(message.substr(1, opcodeEnd - 1).c_str());
     opcode = static_cast<CalibreOpcode>(opcodeValue);
     
+    if (trace) {
+        size_t wireSize = std::to_string(message.length()).length() + message.length();
+        trace->record(SessionTraceRecord::IN, SessionTraceRecord::JSON, opcodeValue,
+                      (uint32_t)wireSize, message.data(), message.length());
+    }
     return true;
 }
 
+int NetworkManager::waitReadable(int timeoutMs) {
+    if (socketFd < 0) return -1;
+    
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(socketFd, &readfds);
+    
+    int result;
+    do {
+        result = select(socketFd + 1, &readfds, NULL, NULL, &timeout);
+    } while (result < 0 && errno == EINTR);
+    
+    if (result < 0) {
+        logMsg("Socket select error: %s", strerror(errno));
+        return -1;
+    }
+    return result > 0 ? 1 : 0;
+}
+
 bool NetworkManager::sendBinaryData(const void* data, size_t length) {
     if (socketFd < 0) {
         logMsg("Cannot send binary data: socket not connected");
         return false;
     }
-    return sendAll(data, length);
+    if (!sendAll(data, length)) return false;
+    if (trace) {
+        trace->record(SessionTraceRecord::OUT, SessionTraceRecord::BINARY, -1, (uint32_t)length, NULL, 0);
+    }
+    return true;
 }
 
 bool NetworkManager::receiveBinaryData(void* buffer, size_t length) {
@@ -420,5 +467,20 @@ bool NetworkManager::receiveBinaryData(void* buffer, size_t length) {
         logMsg("Cannot receive binary data: socket not connected");
         return false;
     }
-    return receiveAll(buffer, length);
+    if (!receiveAll(buffer, length)) return false;
+    if (trace) {
+        trace->record(SessionTraceRecord::IN, SessionTraceRecord::BINARY, -1, (uint32_t)length, NULL, 0);
+    }
+    return true;
+}
+
+bool NetworkManager::startTrace(const std::string& path, bool withBodies) {
+    trace.reset(new SessionTraceWriter());
+    if (trace->open(path, withBodies)) return true;
+    trace.reset();
+    return false;
+}
+
+void NetworkManager::stopTrace() {
+    trace.reset();
 }
@@ -8,6 +8,10 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <atomic>
+
+class SessionTraceWriter;
 
 // Calibre protocol opcodes
 enum CalibreOpcode {
@@ -40,6 +44,10 @@ const int BROADCAST_PORT_COUNT = 5;
 
 class NetworkManager {
 public:
+    // How long a blocking receive, or a wait for the next request, may go
+    // without data before the peer is given up on
+    static const int RECEIVE_TIMEOUT_MS = 300 * 1000;
+    
     NetworkManager();
     ~NetworkManager();
     
@@ -49,18 +57,32 @@ public:
     bool connectToServer(const std::string& host, int port);
     void disconnect();
     
+    // Wakes a blocked send, receive or wait without closing the socket;
+    // safe to call from another thread
+    void interrupt();
+    
     // Communication methods
     bool sendJSON(CalibreOpcode opcode, const char* jsonData);
     bool receiveJSON(CalibreOpcode& opcode, std::string& jsonData);
     bool sendBinaryData(const void* data, size_t length);
     bool receiveBinaryData(void* buffer, size_t length);
     
+    // Waits up to timeoutMs for incoming data.
+    // Returns 1 if readable, 0 on timeout, -1 on error.
+    int waitReadable(int timeoutMs);
+    
     // Connection status
     bool isConnected() const { return socketFd >= 0; }
     
+    // Opt-in frame trace for offline replay (see session_trace.h). JSON
+    // bodies are only recorded with `withBodies`; book data never is.
+    bool startTrace(const std::string& path, bool withBodies);
+    void stopTrace();
+    
 private:
-    int socketFd;
+    std::atomic<int> socketFd;
     int udpSocketFd;
+    std::unique_ptr<SessionTraceWriter> trace;
     
     // Helper methods
     bool createUDPSocket();
@@ -0,0 +1,122 @@
+// calibre-replay: drives the protocol code from a recorded session trace.
+//
+//   calibre-replay <trace> <scratch-dir> [--paced] [--timeline]
+//
+// Received books and the database copy stay under <scratch-dir>; the device
+// library is read once, to seed the copy, and never written. The replay is
+// logged to the usual calibre-connect.log.
+
+#include "network.h"
+#include "book_manager.h"
+#include "library_notifier.h"
+#include "calibre_protocol.h"
+#include "session_replay.h"
+#include "metrics.h"
+#include "timeline.h"
+#include "logger.h"
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+
+static const char* SYSTEM_DB_PATH = "/mnt/ext1/system/explorer-3/explorer-3.db";
+
+static bool makeDir(const std::string& path) {
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// Online backup, so a library the reader has open is copied consistently
+static bool copyDatabase(const char* from, const std::string& to) {
+    sqlite3* source = NULL;
+    sqlite3* target = NULL;
+    bool ok = false;
+
+    if (sqlite3_open_v2(from, &source, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+        sqlite3_open(to.c_str(), &target) == SQLITE_OK) {
+        sqlite3_backup* backup = sqlite3_backup_init(target, "main", source, "main");
+        if (backup) {
+            ok = sqlite3_backup_step(backup, -1) == SQLITE_DONE;
+            sqlite3_backup_finish(backup);
+        }
+        if (!ok) fprintf(stderr, "Database copy failed: %s\n", sqlite3_errmsg(target));
+    }
+
+    sqlite3_close(source);
+    sqlite3_close(target);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <trace> <scratch-dir> [--paced] [--timeline]\n", argv[0]);
+        return 2;
+    }
+
+    std::string tracePath = argv[1];
+    std::string scratch = argv[2];
+    bool paced = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--paced") == 0) paced = true;
+        if (strcmp(argv[i], "--timeline") == 0) Timeline::instance().setEnabled(true);
+    }
+
+    std::string mainRoot = scratch + "/main";
+    std::string cardRoot = scratch + "/card";
+    std::string dbPath = scratch + "/explorer-3.db";
+
+    if (!makeDir(scratch) || !makeDir(mainRoot) || !makeDir(cardRoot)) {
+        fprintf(stderr, "Cannot create %s: %s\n", scratch.c_str(), strerror(errno));
+        return 1;
+    }
+    if (!copyDatabase(SYSTEM_DB_PATH, dbPath)) return 1;
+
+    initLog();
+    setLogLevel(LOG_INFO);
+
+    SessionReplayer replayer;
+    int port = replayer.start(tracePath, paced);
+    if (port < 0) {
+        fprintf(stderr, "Cannot replay %s (see the log)\n", tracePath.c_str());
+        closeLog();
+        return 1;
+    }
+
+    BookManager bookManager;
+    if (!bookManager.initialize(dbPath)) {
+        fprintf(stderr, "Cannot open %s\n", dbPath.c_str());
+        closeLog();
+        return 1;
+    }
+    bookManager.redirectStorage(mainRoot, cardRoot);
+
+    // No cover rendering or cache file; the notifier only counts
+    LibraryNotifier notifier(true);
+    NetworkManager network;
+    std::unique_ptr<CalibreProtocol> protocol(new CalibreProtocol(
+        &network, &bookManager, nullptr, nullptr, &notifier,
+        "#read", "#read_date", "#favorite"));
+
+    long long start = MetricsRegistry::nowMicros();
+    bool handshake = network.connectToServer("127.0.0.1", port) && protocol->performHandshake("");
+    if (handshake) {
+        protocol->handleMessages([](const std::string&) {});
+    } else {
+        fprintf(stderr, "Handshake failed: %s\n", protocol->getErrorMessage().c_str());
+    }
+    protocol->disconnect();
+    network.disconnect();
+    long long elapsed = MetricsRegistry::nowMicros() - start;
+
+    bool complete = replayer.finish();
+    printf("%s: %d frames in %lld ms, %d mismatches, %d size changes%s\n",
+           tracePath.c_str(), replayer.getFramesReplayed(), elapsed / 1000,
+           replayer.getMismatches(), replayer.getSizeChanges(),
+           complete ? "" : ", incomplete");
+
+    protocol.reset();
+    closeLog();
+    return (complete && replayer.getMismatches() == 0) ? 0 : 1;
+}
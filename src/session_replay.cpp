@@ -0,0 +1,208 @@
+#include "session_replay.h"
+#include "logger.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+// A device that stops answering ends the replay instead of hanging it
+static const int REPLY_TIMEOUT_SEC = 30;
+
+static bool writeAll(int fd, const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent = send(fd, p, length, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        p += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buffer, size_t length) {
+    char* p = static_cast<char*>(buffer);
+    while (length > 0) {
+        ssize_t received = recv(fd, p, length, 0);
+        if (received <= 0) return false;
+        p += received;
+        length -= received;
+    }
+    return true;
+}
+
+// Reads one "<length>[opcode, {...}]" frame the way Calibre does
+static bool readFrame(int fd, std::string& message, size_t& wireSize) {
+    std::string digits;
+    char c;
+    while (true) {
+        if (!readAll(fd, &c, 1)) return false;
+        if (c < '0' || c > '9') break;
+        digits += c;
+        if (digits.size() > 10) return false;
+    }
+    if (digits.empty() || c != '[') return false;
+
+    size_t length = strtoul(digits.c_str(), NULL, 10);
+    if (length == 0) return false;
+    message.assign(length, '\0');
+    message[0] = c;
+    if (length > 1 && !readAll(fd, &message[1], length - 1)) return false;
+
+    wireSize = digits.size() + length;
+    return true;
+}
+
+static const char* directionName(int direction) {
+    return direction == SessionTraceRecord::IN ? "in" : "out";
+}
+
+SessionReplayer::SessionReplayer()
+    : paced(false), listenFd(-1), completed(false),
+      framesReplayed(0), mismatches(0), sizeChanges(0) {
+}
+
+SessionReplayer::~SessionReplayer() {
+    if (listenFd >= 0) {
+        shutdown(listenFd, SHUT_RDWR);
+        close(listenFd);
+        listenFd = -1;
+    }
+    if (serverThread.joinable()) serverThread.join();
+}
+
+int SessionReplayer::start(const std::string& tracePath, bool pacedReplay) {
+    SessionTraceReader reader;
+    if (!reader.open(tracePath)) {
+        logMsg("Replay: %s is not a session trace", tracePath.c_str());
+        return -1;
+    }
+    if (!reader.hasBodies()) {
+        logMsg("Replay: %s was recorded without JSON bodies (session_trace=2)", tracePath.c_str());
+        return -1;
+    }
+
+    records.clear();
+    SessionTraceRecord record;
+    while (reader.next(record)) records.push_back(record);
+    if (records.empty()) {
+        logMsg("Replay: %s holds no frames", tracePath.c_str());
+        return -1;
+    }
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t addrLen = sizeof(addr);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, 1) < 0 ||
+        getsockname(listenFd, (struct sockaddr*)&addr, &addrLen) < 0) {
+        logMsg("Replay: cannot listen on loopback: %s", strerror(errno));
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+
+    paced = pacedReplay;
+    int port = ntohs(addr.sin_port);
+    logMsg("Replay: %d frames from %s on port %d%s",
+           (int)records.size(), tracePath.c_str(), port, paced ? ", paced" : "");
+
+    serverThread = std::thread(&SessionReplayer::serve, this);
+    return port;
+}
+
+bool SessionReplayer::finish() {
+    if (serverThread.joinable()) serverThread.join();
+    logMsg("Replay: %d of %d frames, %d mismatches, %d size changes",
+           (int)framesReplayed, (int)records.size(), (int)mismatches, (int)sizeChanges);
+    return completed;
+}
+
+void SessionReplayer::serve() {
+    int fd = accept(listenFd, NULL, NULL);
+    close(listenFd);
+    listenFd = -1;
+    if (fd < 0) return;
+
+    struct timeval tv;
+    tv.tv_sec = REPLY_TIMEOUT_SEC;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    bool ok = true;
+
+    for (size_t i = 0; i < records.size() && ok; i++) {
+        const SessionTraceRecord& record = records[i];
+
+        if (record.direction == SessionTraceRecord::IN) {
+            if (paced) {
+                std::this_thread::sleep_until(startTime + std::chrono::microseconds(record.timeUs));
+            }
+            ok = sendRecord(fd, record);
+        } else {
+            ok = expectRecord(fd, record);
+        }
+
+        if (ok) {
+            framesReplayed++;
+        } else {
+            logMsg("Replay: stopped at frame %d (%s, opcode %d)",
+                   (int)i, directionName(record.direction), record.opcode);
+        }
+    }
+
+    completed = ok;
+
+    // Closing the socket is how Calibre ends a session
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+bool SessionReplayer::sendRecord(int fd, const SessionTraceRecord& record) {
+    if (record.kind == SessionTraceRecord::BINARY) {
+        // Book contents are never traced; the size is all that matters here
+        std::vector<char> zeros(record.size, 0);
+        return zeros.empty() || writeAll(fd, &zeros[0], zeros.size());
+    }
+
+    std::string packet = std::to_string(record.body.size()) + record.body;
+    return writeAll(fd, packet.data(), packet.size());
+}
+
+bool SessionReplayer::expectRecord(int fd, const SessionTraceRecord& record) {
+    if (record.kind == SessionTraceRecord::BINARY) {
+        std::vector<char> buffer(record.size);
+        return buffer.empty() || readAll(fd, &buffer[0], buffer.size());
+    }
+
+    std::string message;
+    size_t wireSize = 0;
+    if (!readFrame(fd, message, wireSize)) {
+        mismatches++;
+        return false;
+    }
+
+    int opcode = atoi(message.c_str() + 1);
+    if (opcode != record.opcode) {
+        logMsg("Replay: expected opcode %d, device sent %d", record.opcode, opcode);
+        mismatches++;
+    } else if (wireSize != record.size) {
+        // Timestamps and free space make some responses drift in size
+        LOG_AT(LOG_DEBUG, "REPLAY", "Opcode %d: %u bytes recorded, %u replayed",
+               opcode, record.size, (unsigned)wireSize);
+        sizeChanges++;
+    }
+    return true;
+}
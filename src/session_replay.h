@@ -0,0 +1,50 @@
+#ifndef SESSION_REPLAY_H
+#define SESSION_REPLAY_H
+
+#include "session_trace.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+// Plays Calibre's side of a recorded session over a loopback socket, so the
+// real NetworkManager and CalibreProtocol can be driven from a trace.
+//
+// Frames the device received are sent back as recorded (book data as zero
+// bytes of the recorded size); frames the device sent are read and checked
+// against the trace. Replay needs a trace recorded with JSON bodies.
+class SessionReplayer {
+public:
+    SessionReplayer();
+    ~SessionReplayer();
+
+    // Loads the trace and listens on 127.0.0.1. Returns the port to connect
+    // to, or -1. With `paced`, the recorded gaps between frames are kept.
+    int start(const std::string& tracePath, bool paced);
+
+    // Waits for the replay to end; false if it stopped before the trace did
+    bool finish();
+
+    int getFramesReplayed() const { return framesReplayed; }
+    int getMismatches() const { return mismatches; }
+    int getSizeChanges() const { return sizeChanges; }
+
+private:
+    std::vector<SessionTraceRecord> records;
+    bool paced;
+    int listenFd;
+    std::thread serverThread;
+    std::atomic<bool> completed;
+    std::atomic<int> framesReplayed;
+    std::atomic<int> mismatches;
+    std::atomic<int> sizeChanges;
+
+    void serve();
+    bool sendRecord(int fd, const SessionTraceRecord& record);
+    bool expectRecord(int fd, const SessionTraceRecord& record);
+
+    SessionReplayer(const SessionReplayer&);
+    SessionReplayer& operator=(const SessionReplayer&);
+};
+
+#endif // SESSION_REPLAY_H
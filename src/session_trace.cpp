@@ -0,0 +1,136 @@
+#include "session_trace.h"
+#include "logger.h"
+#include <chrono>
+#include <cstring>
+
+static const char TRACE_MAGIC[4] = { 'C', 'C', 'T', 'R' };
+static const uint32_t TRACE_VERSION = 1;
+
+// Bodies larger than this are not worth replaying from a file on flash
+static const uint32_t MAX_BODY_SIZE = 16 * 1024 * 1024;
+
+struct TraceFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct TraceRecordHeader {
+    uint8_t direction;
+    uint8_t kind;
+    uint16_t reserved;
+    int32_t opcode;
+    uint32_t size;
+    uint32_t bodySize;
+    uint64_t timeUs;
+};
+
+static long long monotonicUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --- Writer ---
+
+SessionTraceWriter::SessionTraceWriter()
+    : file(nullptr), withBodies(false), startUs(0), records(0) {
+}
+
+SessionTraceWriter::~SessionTraceWriter() {
+    close();
+}
+
+bool SessionTraceWriter::open(const std::string& path, bool bodies) {
+    close();
+
+    file = fopen(path.c_str(), "wb");
+    if (!file) {
+        logMsg("Session trace: cannot create %s", path.c_str());
+        return false;
+    }
+
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.flags = bodies ? TRACE_FLAG_BODIES : 0;
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, file);
+
+    withBodies = bodies;
+    startUs = monotonicUs();
+    records = 0;
+    logMsg("Session trace: recording to %s%s", path.c_str(), bodies ? " with JSON bodies" : "");
+    return true;
+}
+
+void SessionTraceWriter::close() {
+    if (!file) return;
+    fclose(file);
+    file = nullptr;
+    logMsg("Session trace: %lld frames recorded", records);
+}
+
+void SessionTraceWriter::record(int direction, int kind, int opcode, uint32_t size,
+                                const char* body, size_t bodySize) {
+    if (!file) return;
+    if (!withBodies || !body) bodySize = 0;
+
+    TraceRecordHeader header;
+    header.direction = (uint8_t)direction;
+    header.kind = (uint8_t)kind;
+    header.reserved = 0;
+    header.opcode = opcode;
+    header.size = size;
+    header.bodySize = (uint32_t)bodySize;
+    header.timeUs = (uint64_t)(monotonicUs() - startUs);
+
+    // Buffered by stdio; written out when the buffer fills or at close
+    fwrite(&header, sizeof(header), 1, file);
+    if (bodySize > 0) fwrite(body, 1, bodySize, file);
+    records++;
+}
+
+// --- Reader ---
+
+SessionTraceReader::SessionTraceReader() : file(nullptr), flags(0) {
+}
+
+SessionTraceReader::~SessionTraceReader() {
+    if (file) fclose(file);
+}
+
+bool SessionTraceReader::open(const std::string& path) {
+    file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION) {
+        fclose(file);
+        file = nullptr;
+        return false;
+    }
+    flags = header.flags;
+    return true;
+}
+
+bool SessionTraceReader::next(SessionTraceRecord& record) {
+    if (!file) return false;
+
+    TraceRecordHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1) return false;
+    if (header.bodySize > MAX_BODY_SIZE) return false;
+
+    record.direction = header.direction;
+    record.kind = header.kind;
+    record.opcode = header.opcode;
+    record.size = header.size;
+    record.timeUs = header.timeUs;
+    record.body.resize(header.bodySize);
+    if (header.bodySize > 0 && fread(&record.body[0], 1, header.bodySize, file) != header.bodySize) {
+        return false;
+    }
+    return true;
+}
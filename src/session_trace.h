@@ -0,0 +1,75 @@
+#ifndef SESSION_TRACE_H
+#define SESSION_TRACE_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+
+// Binary trace of the frames exchanged with Calibre, written by
+// NetworkManager when tracing is enabled and read back by SessionReplayer.
+//
+// Layout (native-endian, read only on the device that wrote it):
+//   header  "CCTR", u32 version, u32 flags, u32 reserved
+//   record  u8 direction, u8 kind, u16 reserved, i32 opcode, u32 size,
+//           u32 bodySize, u64 time (us since the trace started), body
+//
+// JSON records carry the whole "[opcode, {...}]" message as their body
+// when TRACE_FLAG_BODIES is set; binary records never carry a body.
+struct SessionTraceRecord {
+    enum Direction { IN = 0, OUT = 1 };
+    enum Kind { JSON = 0, BINARY = 1 };
+
+    int direction;
+    int kind;
+    int opcode;         // -1 for binary
+    uint32_t size;      // Bytes on the wire
+    uint64_t timeUs;
+    std::string body;   // Empty unless recorded
+
+    SessionTraceRecord() : direction(IN), kind(JSON), opcode(-1), size(0), timeUs(0) {}
+};
+
+class SessionTraceWriter {
+public:
+    static const uint32_t TRACE_FLAG_BODIES = 1;
+
+    SessionTraceWriter();
+    ~SessionTraceWriter();
+
+    bool open(const std::string& path, bool withBodies);
+    void close();
+    bool isOpen() const { return file != nullptr; }
+
+    void record(int direction, int kind, int opcode, uint32_t size,
+                const char* body, size_t bodySize);
+
+private:
+    FILE* file;
+    bool withBodies;
+    long long startUs;
+    long long records;
+
+    SessionTraceWriter(const SessionTraceWriter&);
+    SessionTraceWriter& operator=(const SessionTraceWriter&);
+};
+
+class SessionTraceReader {
+public:
+    SessionTraceReader();
+    ~SessionTraceReader();
+
+    bool open(const std::string& path);
+    bool hasBodies() const { return (flags & SessionTraceWriter::TRACE_FLAG_BODIES) != 0; }
+
+    // False at the end of the trace or on a torn record
+    bool next(SessionTraceRecord& record);
+
+private:
+    FILE* file;
+    uint32_t flags;
+
+    SessionTraceReader(const SessionTraceReader&);
+    SessionTraceReader& operator=(const SessionTraceReader&);
+};
+
+#endif // SESSION_TRACE_H
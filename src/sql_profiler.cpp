@@ -0,0 +1,213 @@
+#include "sql_profiler.h"
+#include "logger.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+static long long monotonicMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Same back-off as SQLite's default busy handler
+static const int BUSY_DELAYS_MS[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+static const int BUSY_DELAY_COUNT = sizeof(BUSY_DELAYS_MS) / sizeof(BUSY_DELAYS_MS[0]);
+
+static bool isWriteStatement(const char* sql) {
+    while (*sql == ' ' || *sql == '\t' || *sql == '\n' || *sql == '\r') sql++;
+    return strncasecmp(sql, "INSERT", 6) == 0 || strncasecmp(sql, "UPDATE", 6) == 0 ||
+           strncasecmp(sql, "DELETE", 6) == 0 || strncasecmp(sql, "REPLACE", 7) == 0;
+}
+
+static bool hasQueryPlan(const std::string& sql) {
+    size_t start = sql.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) return false;
+    const char* s = sql.c_str() + start;
+    return strncasecmp(s, "SELECT", 6) == 0 || strncasecmp(s, "WITH", 4) == 0 ||
+           isWriteStatement(s);
+}
+
+SqlProfiler::SqlProfiler() {
+}
+
+SqlProfiler::~SqlProfiler() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = connections.begin(); it != connections.end(); ++it) {
+        sqlite3_trace_v2(it->first, 0, NULL, NULL);
+        sqlite3_busy_timeout(it->first, it->second->busyTimeoutMs);
+    }
+}
+
+void SqlProfiler::attach(sqlite3* db, int busyTimeoutMs) {
+    if (!db) return;
+
+    Connection* conn = new Connection();
+    conn->owner = this;
+    conn->db = db;
+    conn->current = nullptr;
+    conn->busyTimeoutMs = busyTimeoutMs;
+    conn->waitStartMs = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        connections[db].reset(conn);
+    }
+
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW,
+                     traceCallback, conn);
+    sqlite3_busy_handler(db, busyCallback, conn);
+}
+
+void SqlProfiler::detach(sqlite3* db) {
+    if (!db) return;
+
+    sqlite3_trace_v2(db, 0, NULL, NULL);
+    sqlite3_busy_handler(db, NULL, NULL);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    connections.erase(db);
+}
+
+void SqlProfiler::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    running.clear();
+    for (auto it = connections.begin(); it != connections.end(); ++it) {
+        it->second->current = nullptr;
+    }
+    entries.clear();
+}
+
+SqlProfiler::Entry* SqlProfiler::entryFor(sqlite3_stmt* stmt) {
+    auto run = running.find(stmt);
+    if (run != running.end()) return run->second;
+
+    const char* sql = sqlite3_sql(stmt);
+    if (!sql) return nullptr;
+
+    std::unique_ptr<Entry>& slot = entries[sql];
+    if (!slot) {
+        slot.reset(new Entry());
+        slot->sql = sql;
+        slot->isWrite = isWriteStatement(sql);
+        slot->calls = 0;
+        slot->totalNs = 0;
+        slot->maxNs = 0;
+        slot->rows = 0;
+        slot->fullScanSteps = 0;
+        slot->busyMs = 0;
+    }
+    running[stmt] = slot.get();
+    return slot.get();
+}
+
+int SqlProfiler::traceCallback(unsigned type, void* ctx, void* p, void* x) {
+    Connection* conn = static_cast<Connection*>(ctx);
+    SqlProfiler* self = conn->owner;
+    sqlite3_stmt* stmt = static_cast<sqlite3_stmt*>(p);
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+
+    if (type == SQLITE_TRACE_STMT) {
+        // Statements run by triggers report as "-- comment"; keep the outer one
+        const char* text = static_cast<const char*>(x);
+        if (text && text[0] == '-' && text[1] == '-') return 0;
+
+        // A prepared statement may have been finalised and its address reused
+        self->running.erase(stmt);
+        conn->current = self->entryFor(stmt);
+    } else if (type == SQLITE_TRACE_ROW) {
+        Entry* entry = self->entryFor(stmt);
+        if (entry) entry->rows++;
+    } else if (type == SQLITE_TRACE_PROFILE) {
+        Entry* entry = self->entryFor(stmt);
+        if (!entry) return 0;
+
+        long long ns = (long long)*static_cast<sqlite3_int64*>(x);
+        entry->calls++;
+        entry->totalNs += ns;
+        if (ns > entry->maxNs) entry->maxNs = ns;
+        entry->fullScanSteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        if (entry->isWrite) {
+            entry->rows += sqlite3_changes(conn->db);
+        }
+        if (conn->current == entry) conn->current = nullptr;
+    }
+    return 0;
+}
+
+int SqlProfiler::busyCallback(void* ctx, int count) {
+    Connection* conn = static_cast<Connection*>(ctx);
+
+    long long now = monotonicMs();
+    if (count == 0) conn->waitStartMs = now;
+    if (now - conn->waitStartMs >= conn->busyTimeoutMs) return 0;
+
+    int delay = BUSY_DELAYS_MS[count < BUSY_DELAY_COUNT ? count : BUSY_DELAY_COUNT - 1];
+    usleep(delay * 1000);
+
+    long long slept = monotonicMs() - now;
+    std::lock_guard<std::mutex> lock(conn->owner->mutex);
+    if (conn->current) conn->current->busyMs += slept;
+    return 1;
+}
+
+bool SqlProfiler::writeReport(const std::string& path, sqlite3* planDb) {
+    std::vector<Entry> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            snapshot.push_back(*it->second);
+        }
+    }
+    if (snapshot.empty()) return true;
+
+    std::sort(snapshot.begin(), snapshot.end(), [](const Entry& a, const Entry& b) {
+        return a.totalNs > b.totalNs;
+    });
+
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        logMsg("SQL profile: cannot write %s", path.c_str());
+        return false;
+    }
+
+    time_t now = time(NULL);
+    fprintf(f, "SQL profile, %d statements, written %s\n", (int)snapshot.size(), ctime(&now));
+
+    long long sessionNs = 0;
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        const Entry& e = snapshot[i];
+        sessionNs += e.totalNs;
+
+        fprintf(f, "#%d calls=%lld total=%.1fms max=%.1fms avg=%.0fus rows=%lld fullscan_steps=%lld busy=%lldms\n",
+                (int)i + 1, e.calls, e.totalNs / 1e6, e.maxNs / 1e6,
+                e.calls ? e.totalNs / 1e3 / e.calls : 0.0,
+                e.rows, e.fullScanSteps, e.busyMs);
+        fprintf(f, "  %s\n", e.sql.c_str());
+
+        if (!planDb || !hasQueryPlan(e.sql)) continue;
+
+        // Captured here rather than in the trace callback so profiling never
+        // prepares statements on a connection that is mid-step
+        sqlite3_stmt* plan;
+        std::string explain = "EXPLAIN QUERY PLAN " + e.sql;
+        if (sqlite3_prepare_v2(planDb, explain.c_str(), -1, &plan, nullptr) != SQLITE_OK) {
+            fprintf(f, "  plan: unavailable (%s)\n", sqlite3_errmsg(planDb));
+            continue;
+        }
+        while (sqlite3_step(plan) == SQLITE_ROW) {
+            const char* detail = (const char*)sqlite3_column_text(plan, 3);
+            fprintf(f, "  plan: %s\n", detail ? detail : "");
+        }
+        sqlite3_finalize(plan);
+    }
+    fprintf(f, "\nTotal statement time: %.1f ms\n", sessionNs / 1e6);
+    fclose(f);
+
+    logMsg("SQL profile: %d statements, %.1f ms, written to %s",
+           (int)snapshot.size(), sessionNs / 1e6, path.c_str());
+    return true;
+}
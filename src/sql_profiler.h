@@ -0,0 +1,66 @@
+#ifndef SQL_PROFILER_H
+#define SQL_PROFILER_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sqlite3.h>
+
+// Opt-in statement profiler for explorer-3.db connections.
+// Attached connections report every statement through sqlite3_trace_v2:
+// executions, cumulative and worst run time, rows returned or changed,
+// full-scan steps and time spent waiting on locks. The query plan of each
+// distinct statement is captured once when the report is written.
+class SqlProfiler {
+public:
+    SqlProfiler();
+    ~SqlProfiler();
+
+    // Installs the trace and busy handlers. The busy handler replaces
+    // sqlite3_busy_timeout() and gives up after `busyTimeoutMs`.
+    void attach(sqlite3* db, int busyTimeoutMs);
+    void detach(sqlite3* db);
+
+    // Writes the per-statement report, slowest first. Query plans are
+    // taken on `planDb`; statements on temporary tables report none.
+    bool writeReport(const std::string& path, sqlite3* planDb);
+
+    void reset();
+
+private:
+    struct Entry {
+        std::string sql;
+        bool isWrite;
+        long long calls;
+        long long totalNs;
+        long long maxNs;
+        long long rows;
+        long long fullScanSteps;
+        long long busyMs;
+    };
+
+    struct Connection {
+        SqlProfiler* owner;
+        sqlite3* db;
+        Entry* current;
+        int busyTimeoutMs;
+        long long waitStartMs;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<Entry> > entries; // SQL text -> stats
+    std::unordered_map<sqlite3_stmt*, Entry*> running;
+    std::map<sqlite3*, std::unique_ptr<Connection> > connections;
+
+    Entry* entryFor(sqlite3_stmt* stmt);
+
+    static int traceCallback(unsigned type, void* ctx, void* p, void* x);
+    static int busyCallback(void* ctx, int count);
+
+    SqlProfiler(const SqlProfiler&);
+    SqlProfiler& operator=(const SqlProfiler&);
+};
+
+#endif // SQL_PROFILER_H
@@ -0,0 +1,133 @@
+#include "timeline.h"
+#include "metrics.h"
+#include "logger.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+
+static int currentThreadId() {
+    static thread_local int tid = 0;
+    if (tid == 0) tid = (int)syscall(SYS_gettid);
+    return tid;
+}
+
+// Details are paths and similar; quotes, backslashes and control
+// characters are all that need escaping
+static void writeEscaped(FILE* f, const std::string& text) {
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+}
+
+Timeline& Timeline::instance() {
+    static Timeline timeline;
+    return timeline;
+}
+
+Timeline::Timeline() : enabled(false), originUs(MetricsRegistry::nowMicros()), dropped(0) {
+}
+
+void Timeline::begin() {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+    originUs = MetricsRegistry::nowMicros();
+    dropped = 0;
+}
+
+void Timeline::setThreadName(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    threadNames[currentThreadId()] = name;
+}
+
+void Timeline::addSpan(const char* name, const char* category, long long startUs, long long durationUs,
+                       const std::string& detail) {
+    if (!isEnabled()) return;
+
+    int tid = currentThreadId();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (events.size() >= MAX_EVENTS) {
+        dropped++;
+        return;
+    }
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.tid = tid;
+    event.startUs = startUs;
+    event.durationUs = durationUs;
+    event.detail = detail;
+    events.push_back(event);
+}
+
+bool Timeline::writeJson(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string tmpPath = path + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "w");
+    if (!f) return false;
+
+    int pid = (int)getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"calibre-connect\"}}", pid);
+
+    for (std::map<int, std::string>::const_iterator it = threadNames.begin(); it != threadNames.end(); ++it) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                pid, it->first);
+        writeEscaped(f, it->second);
+        fprintf(f, "\"}}");
+    }
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& e = events[i];
+        // Spans that started before begin() are clipped to it
+        long long ts = e.startUs - originUs;
+        long long dur = e.durationUs;
+        if (ts < 0) {
+            dur += ts;
+            ts = 0;
+            if (dur < 0) continue;
+        }
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                e.name, e.category, ts, dur, pid, e.tid);
+        if (!e.detail.empty()) {
+            fprintf(f, ",\"args\":{\"detail\":\"");
+            writeEscaped(f, e.detail);
+            fprintf(f, "\"}");
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) return false;
+
+    logMsg("Timeline: %d spans written to %s, %d dropped", (int)events.size(), path.c_str(), (int)dropped);
+    return true;
+}
+
+TimelineSpan::TimelineSpan(const char* name, const char* category)
+    : name(name), category(category),
+      start(Timeline::instance().isEnabled() ? MetricsRegistry::nowMicros() : 0) {
+}
+
+TimelineSpan::TimelineSpan(const char* name, const char* category, const std::string& detail)
+    : name(name), category(category), start(0) {
+    if (!Timeline::instance().isEnabled()) return;
+    this->detail = detail;
+    start = MetricsRegistry::nowMicros();
+}
+
+TimelineSpan::~TimelineSpan() {
+    if (start == 0) return;
+    Timeline::instance().addSpan(name, category, start, MetricsRegistry::nowMicros() - start, detail);
+}
@@ -0,0 +1,77 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+// Opt-in timeline of a session as Chrome trace-event JSON, for Perfetto or
+// chrome://tracing. Spans carry the thread they ran on, so overlap between
+// the connection thread, the DB writer and the cover worker is visible.
+//
+// When disabled, a span costs one atomic load.
+class Timeline {
+public:
+    // Spans beyond this are dropped and counted
+    static const size_t MAX_EVENTS = 50000;
+
+    static Timeline& instance();
+
+    void setEnabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+    bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // Clears recorded spans; times are written relative to this point
+    void begin();
+
+    // Names the calling thread in the output
+    void setThreadName(const char* name);
+
+    // `name` and `category` must outlive the timeline (string literals)
+    void addSpan(const char* name, const char* category, long long startUs, long long durationUs,
+                 const std::string& detail = std::string());
+
+    bool writeJson(const std::string& path);
+
+private:
+    struct Event {
+        const char* name;
+        const char* category;
+        int tid;
+        long long startUs;
+        long long durationUs;
+        std::string detail;
+    };
+
+    std::atomic<bool> enabled;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::map<int, std::string> threadNames;
+    long long originUs;
+    size_t dropped;
+
+    Timeline();
+
+    Timeline(const Timeline&);
+    Timeline& operator=(const Timeline&);
+};
+
+// Records the lifetime of the scope as a span
+class TimelineSpan {
+public:
+    TimelineSpan(const char* name, const char* category);
+    TimelineSpan(const char* name, const char* category, const std::string& detail);
+    ~TimelineSpan();
+
+private:
+    const char* name;
+    const char* category;
+    long long start; // 0 when the timeline was disabled at entry
+    std::string detail;
+
+    TimelineSpan(const TimelineSpan&);
+    TimelineSpan& operator=(const TimelineSpan&);
+};
+
+#endif // TIMELINE_H